@@ -10,6 +10,7 @@
 #include "opencv2/video/background_segm.hpp"
 #include "opencv2/videoio.hpp"
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <vector>
 
@@ -2,9 +2,99 @@
 #define _FPENHANCEMENT_H
 
 #include "common.h"
+#include "gabor_bank.h"
+#include "pipeline_stats.h"
+#include "workspace.h"
 
+#include <mutex>
+
+/*
+ * Gabor filter based fingerprint enhancement.
+ *
+ * Every processing member is const. The only state shared by the calls is
+ * the GaborBank cache and the timings returned by lastStats, both guarded
+ * by a mutex, so one extractor can serve several threads as long as each
+ * thread passes its own Workspace.
+ */
 class FPEnhancement {
 public:
+    // Algorithm used to apply the Gabor filter bank
+    enum GaborBackend {
+        // Pick the fastest backend according to the kernel size
+        GABOR_AUTO = 0,
+        // Evaluate the filter of each pixel on its own window
+        GABOR_DIRECT = 1,
+        // Convolve the image with every filter in the frequency domain
+        GABOR_FFT = 2,
+        // Group the pixels by orientation so that each filter stays in cache
+        GABOR_BUCKETED = 3,
+        // Filter each block of pixels with the filter of its dominant
+        // orientation. Much faster, but approximate.
+        GABOR_BLOCK = 4
+    };
+
+    // Intermediate fields that enhance can return
+    enum EnhancementOutput {
+        // Ridge orientation in radians, CV_32FC1
+        OUTPUT_ORIENTATION = 1,
+        // Coherence of the structure tensor in [0, 1], CV_32FC1
+        OUTPUT_COHERENCE = 2,
+        // Ridge frequency used by the Gabor filters, CV_32FC1
+        OUTPUT_FREQUENCY = 4,
+        // Foreground mask of postProcessingFilter, CV_8UC1
+        OUTPUT_MASK = 8
+    };
+
+    // Enhanced image and the requested fields, all of the size of the image.
+    // Fields that were not requested are empty.
+    struct EnhancementResult {
+        cv::Mat enhanced;
+        cv::Mat orientation;
+        cv::Mat coherence;
+        cv::Mat frequency;
+        cv::Mat mask;
+        PipelineStats stats;
+    };
+
+    // Parameters varied by sweep. The others are the ones of the extractor.
+    struct SweepPoint {
+        double kx, ky;
+        double blockSigma;
+        double gradientSigma;
+        double orientSmoothSigma;
+        double freqValue;
+    };
+
+    // Every constructor parameter, in the order of the constructor, so that
+    // a variant of an extractor can be built by changing a few of them
+    struct Parameters {
+        double kx, ky;
+        double blockSigma;
+        double gradientSigma;
+        double orientSmoothSigma;
+        double freqValue;
+        int ddepth;
+        bool addBorder;
+        int cannyLowThreshold;
+        int cannyRatio;
+        int kernelSize;
+        int blurringTimes;
+        int dilationSize;
+        int dilationType;
+        bool verbose;
+        int gaborBackend;
+        int numThreads;
+        bool estimateFrequency;
+        int gaborBlockSize;
+        double maskScale;
+        size_t memoryBudget;
+        bool recursiveSmoothing;
+        int orientationScale;
+        int normalizationWindow;
+        bool fixedPoint;
+        int angleInc;
+    };
+
     FPEnhancement(double kx = 0.8,
                   double ky = 0.8,
                   double blockSigma = 5.0,
@@ -21,7 +111,33 @@ public:
                   int blurringTimes = 30,
                   int dilationSize = 10,
                   int dilationType = 1,
-                  bool verbose = false) : kx(kx),
+                  bool verbose = false,
+                  int gaborBackend = GABOR_AUTO,
+                  // Number of threads used by the Gabor filtering and by the batches.
+                  // 0 lets OpenCV decide, and uses every core for the batches.
+                  int numThreads = 0,
+                  // Estimate the ridge frequency block-wise instead of using freqValue
+                  bool estimateFrequency = false,
+                  // Size of the tiles of the GABOR_BLOCK backend
+                  int gaborBlockSize = 16,
+                  // Scale at which the foreground mask of extractMaskedFingerPrints is computed
+                  double maskScale = 1.0,
+                  // Peak memory in bytes used by the pipeline, which is then run tile by tile.
+                  // 0 disables the tiling.
+                  size_t memoryBudget = 0,
+                  // Use a recursive Gaussian for the large orientation smoothings
+                  bool recursiveSmoothing = false,
+                  // Estimate the orientation on an image downsampled by this power of two
+                  int orientationScale = 1,
+                  // Normalize each pixel over a window of this size instead of the whole image.
+                  // 0 uses the global statistics.
+                  int normalizationWindow = 0,
+                  // Evaluate the Gabor filters of the direct and bucketed backends
+                  // in 16 bit fixed point instead of float
+                  bool fixedPoint = false,
+                  // Angle between the orientations of the Gabor filters in degrees,
+                  // which has to divide 180
+                  int angleInc = 3) : kx(kx),
                                           ky(ky),
                                           blockSigma(blockSigma),
                                           gradientSigma(gradientSigma),
@@ -35,28 +151,210 @@ public:
                                           blurringTimes(blurringTimes),
                                           dilationSize(dilationSize),
                                           dilationType(dilationType),
-                                          verbose(verbose){};
+                                          verbose(verbose),
+                                          gaborBackend(gaborBackend),
+                                          numThreads(numThreads),
+                                          estimateFrequency(estimateFrequency),
+                                          gaborBlockSize(gaborBlockSize),
+                                          maskScale(maskScale),
+                                          memoryBudget(memoryBudget),
+                                          recursiveSmoothing(recursiveSmoothing),
+                                          orientationScale(orientationScale),
+                                          normalizationWindow(normalizationWindow),
+                                          fixedPoint(fixedPoint),
+                                          angleInc(angleInc) {
+        // The tiling and the halos depend on them before any stage runs
+        CV_Assert(orientationScale >= 1 && (orientationScale & (orientationScale - 1)) == 0);
+        CV_Assert(angleInc > 0 && 180 % angleInc == 0);
+    };
+
+    explicit FPEnhancement(const Parameters &p)
+            : FPEnhancement(p.kx, p.ky, p.blockSigma, p.gradientSigma, p.orientSmoothSigma, p.freqValue,
+                            p.ddepth, p.addBorder, p.cannyLowThreshold, p.cannyRatio, p.kernelSize,
+                            p.blurringTimes, p.dilationSize, p.dilationType, p.verbose, p.gaborBackend,
+                            p.numThreads, p.estimateFrequency, p.gaborBlockSize, p.maskScale,
+                            p.memoryBudget, p.recursiveSmoothing, p.orientationScale,
+                            p.normalizationWindow, p.fixedPoint, p.angleInc){};
+
+    // Copies have the same parameters, and start with empty stats of their
+    // own as the mutex guarding them can be neither copied nor moved
+    FPEnhancement(const FPEnhancement &other) : FPEnhancement(other.parameters()){};
+    FPEnhancement(FPEnhancement &&other) : FPEnhancement(other.parameters()){};
 
-    cv::Mat extractFingerPrints(const cv::Mat &inputImage);
+    // Parameters of the extractor. FPEnhancement().parameters() gives the
+    // defaults.
+    Parameters parameters() const;
+
+    cv::Mat extractFingerPrints(const cv::Mat &inputImage) const;
+
+    // Same, reusing the buffers of `workspace` and of `enhancedImage`
+    void extractFingerPrints(const cv::Mat &inputImage, cv::Mat &enhancedImage, Workspace &workspace) const;
 
     cv::Mat postProcessingFilter(const cv::Mat &inputImage) const;
 
+    // Equivalent to masking extractFingerPrints with postProcessingFilter,
+    // but only processes the foreground
+    cv::Mat extractMaskedFingerPrints(const cv::Mat &inputImage) const;
+
+    // Enhanced image along with the fields selected by the EnhancementOutput
+    // flags of `outputs`. `masked` only enhances the foreground.
+    EnhancementResult enhance(const cv::Mat &inputImage, int outputs = 0, bool masked = false) const;
+
+    // Same, reusing the buffers of `workspace`
+    EnhancementResult enhance(const cv::Mat &inputImage, int outputs, bool masked,
+                              Workspace &workspace) const;
+
+    // extractFingerPrints and extractMaskedFingerPrints of every image,
+    // balanced across numThreads threads
+    cv::vector<cv::Mat> extractBatch(const cv::vector<cv::Mat> &inputImages) const;
+    cv::vector<cv::Mat> extractMaskedBatch(const cv::vector<cv::Mat> &inputImages) const;
+
+    // Parameters of the extractor, as a starting point for sweep grids
+    SweepPoint sweepPoint() const;
+
+    // Result of extractFingerPrints for each point of `points`, sharing the
+    // stages that do not depend on the varied parameters
+    cv::vector<cv::Mat> sweep(const cv::Mat &inputImage, const cv::vector<SweepPoint> &points) const;
+
+    // Time spent in each stage by the last extraction. The workspace of an
+    // extraction also holds its own timings.
+    PipelineStats lastStats() const;
+
+    // Compact 1 bit per pixel representation of the CV_8UC1 ridge maps
+    static cv::Mat packRidgeMap(const cv::Mat &ridgeMap);
+    static cv::Mat unpackRidgeMap(const cv::Mat &packed, int cols);
+
+    // Orientation of the ridges of the normalized image, in radians
+    cv::Mat orientationField(const cv::Mat &inputImage) const;
+
 private:
     const bool verbose;
 
+    mutable std::mutex statsMutex;
+    mutable PipelineStats publishedStats;
+    void publish_stats(const PipelineStats &stats) const;
+
+    void enhance_image(const cv::Mat &inputImage, const cv::Mat &mask,
+                       Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                       int outputs = 0, EnhancementResult *fields = nullptr) const;
+    void enhance_normalized(const cv::Mat &normalizedImage, const cv::Mat &mask,
+                            Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                            int outputs = 0, EnhancementResult *fields = nullptr) const;
+    static void place(const cv::Mat &field, const cv::Rect &region, const cv::Rect &part,
+                      const cv::Size &size, cv::Mat &wholeField);
+    static cv::Mat blurred_grey(const cv::Mat &inputImage, Workspace &workspace);
+
+    cv::vector<cv::Mat> extract_batch(const cv::vector<cv::Mat> &inputImages, bool masked) const;
+
+    std::unique_ptr<const FPEnhancement> with_parameters(const SweepPoint &point) const;
+
+    // Tiled execution
+    const size_t memoryBudget;
+    void enhance_tiled(const cv::Mat &inputImage, const cv::Mat &mask,
+                       Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                       int outputs = 0, EnhancementResult *fields = nullptr) const;
+    int orientation_halo() const;
+    int pipeline_halo() const;
+
     // Image normalization
-    static cv::Mat normalize_image(const cv::Mat &im, double reqMean, double reqVar);
-    static float deviation(const cv::Mat &im, float ave);
+    const int normalizationWindow;
+    cv::Mat normalize_blurred(const cv::Mat &blurredImage, const cv::Mat &mask, Workspace &workspace) const;
+    cv::Mat local_normalize(const cv::Mat &im, const cv::Mat &mask, Workspace &workspace) const;
+    void integral_wrapped(const cv::Mat &im, const cv::Mat &mask,
+                          cv::Mat &sums, cv::Mat &squares, cv::Mat &counts) const;
+    static void normalize_image(const cv::Mat &im, double reqMean, double reqVar,
+                                const cv::Mat &mask, cv::Mat &normalizedImage);
+    static void accumulate_statistics(const cv::Mat &im, const cv::Mat &mask,
+                                      double &sum, double &sumSquares, double &count);
+    static void mean_deviation(double sum, double sumSquares, double count, double &mean, double &stdDev);
 
     // For calculating orientation field
     const int ddepth;
-    void gradient(const cv::Mat &image, cv::Mat &xGradient, cv::Mat &yGradient) const;
-    cv::Mat orient_ridge(const cv::Mat &im);
+    const bool recursiveSmoothing;
+    const int orientationScale;
+    static void gradient_kernels(int kernelSize, double sigma, cv::Mat &smoothKernel, cv::Mat &derivativeKernel);
+    void gaussian_smooth(const cv::Mat &src, cv::Mat &dst, int kernelSize, double sigma) const;
+    void recursive_gaussian(const cv::Mat &src, cv::Mat &dst, double sigma) const;
+    static void recursive_gaussian_coefficients(double sigma, double *coefficients);
+    cv::Mat orient_ridge(const cv::Mat &im, Workspace &workspace,
+                         cv::Mat *coherence = nullptr, bool indexed = false) const;
+    static int smoothing_size(double sigma);
+    int smoothing_radius(double sigma) const;
+    void doubled_angles(const cv::Mat &im, int scale, Workspace &workspace, cv::Mat *coherence,
+                        const std::function<void(int, int, int, const float *, const float *)> &emit) const;
+
+    // For estimating ridge frequency
+    const bool estimateFrequency;
+    cv::Mat ridge_freq(const cv::Mat &im, const cv::Mat &orientim) const;
+    static float block_freq(const cv::Mat &block, const cv::Mat &orientBlock);
 
     // For filtering ridges
+    // Angle increment between filter orientations in degrees
+    const int angleInc;
     const bool addBorder;
-    static void meshgrid(int kernelSize, cv::Mat &meshX, cv::Mat &meshY);
-    cv::Mat filter_ridge(const cv::Mat &inputImage, const cv::Mat &orientationImage, const cv::Mat &frequency) const;
+    const int gaborBackend;
+    const int gaborBlockSize;
+    const bool fixedPoint;
+
+    // Filters of every bank needed for an image and the filter of each pixel
+    struct FilterSelection {
+        cv::vector<std::shared_ptr<const GaborBank>> banks;
+        // Filters of every bank, bank-major: filters[b * orientCount + o]
+        cv::vector<cv::Mat> filters;
+        // Same filters, quantized to CV_16SC1. Only filled for the fixed
+        // point filtering.
+        cv::vector<cv::Mat> fixedFilters;
+        int orientCount;
+        // Largest half size of the filters
+        int maxSzek;
+        // Quantized orientation of each pixel, CV_8UC1
+        cv::Mat orientindex;
+        // Bank of each blockSize x blockSize block, CV_8UC1. Empty when
+        // there is a single bank.
+        cv::Mat blockBank;
+        int blockSize;
+        // Pixels to filter, CV_8UC1. Empty when every pixel is filtered.
+        cv::Mat mask;
+
+        int bankAt(int r, int c) const {
+            return blockBank.empty() ? 0 : blockBank.at<uchar>(r / blockSize, c / blockSize);
+        }
+
+        // Index of the filter of a pixel, or -1 if it is masked out
+        int filterAt(int r, int c) const {
+            if (!mask.empty() && !mask.at<uchar>(r, c)) {
+                return -1;
+            }
+            return bankAt(r, c) * orientCount + orientindex.at<uchar>(r, c);
+        }
+    };
+
+    void filter_ridge(const cv::Mat &inputImage, const cv::Mat &orientationImage,
+                      const cv::Mat &frequency, const cv::Mat &mask, Workspace &workspace,
+                      cv::Mat &enhancedImage, int *maxSzek = nullptr) const;
+    static void add_border(cv::Mat &enhancedImage, int szek);
+    void select_filters(const cv::Mat &frequency, int angleInc, FilterSelection &selection) const;
+    static cv::Rect valid_region(int rows, int cols, int szek);
+    int resolve_backend(int kernelSize, int filterCount, int rows, int cols) const;
+    static bool prefer_fft(int kernelSize, int filterCount, int rows, int cols);
+    void filter_ridge_fft(const cv::Mat &inputImage, const FilterSelection &selection,
+                          const cv::Rect &valid, cv::Mat &enhancedImage) const;
+    void filter_ridge_block(const cv::Mat &inputImage, const cv::Mat &orientationImage,
+                            const FilterSelection &selection, const cv::Rect &valid,
+                            cv::Mat &enhancedImage) const;
+    // The direct and bucketed backends take a CV_32FC1 image, or a CV_16SC1
+    // one with T = short for the fixed point filtering
+    template <typename T>
+    static void filter_ridge_direct(const cv::Mat &inputImage, const FilterSelection &selection,
+                                    const cv::Rect &region, cv::Mat &enhancedImage);
+    template <typename T>
+    static void filter_ridge_bucketed(const cv::Mat &inputImage, const FilterSelection &selection,
+                                      const cv::Rect &region, Workspace::Band &buffers,
+                                      cv::Mat &enhancedImage);
+
+    // Parallelism
+    const int numThreads;
+    void run_parallel(const cv::Range &range, const std::function<void(const cv::Range &)> &body) const;
 
     const double kx, ky;
     const double blockSigma;
@@ -65,6 +363,8 @@ private:
     const double freqValue;
 
     // Post processingFiltering
+    const double maskScale;
+    cv::Mat foreground_mask(const cv::Mat &inputImage, double scale) const;
     const int cannyLowThreshold;
     const int cannyRatio;
     const int kernelSize;
@@ -0,0 +1,54 @@
+// Bank of rotated Gabor filters used for ridge filtering
+
+#ifndef _GABOR_BANK_H
+#define _GABOR_BANK_H
+
+#include "common.h"
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+class GaborBank {
+public:
+    // Half size of the filters, which are (2 * szek) x (2 * szek)
+    const int szek;
+
+    // One filter per orientation, the m-th one being tuned for ridges
+    // oriented at m * angleInc degrees. Filters are continuous CV_32FC1.
+    const cv::vector<cv::Mat> filters;
+
+    // Same filters quantized to CV_16SC1 for the fixed point filtering, see
+    // gabor::fixedInputScale. Only the sign of their response is meaningful.
+    // They are built on the first call, so that banks only used in floating
+    // point do not carry them. This function is thread-safe.
+    const cv::vector<cv::Mat> &fixedFilters() const;
+
+    /*
+     * Return the bank for the given parameters.
+     *
+     * Banks only depend on their parameters, so they are built once and
+     * shared by every caller of the process. This function is thread-safe.
+     */
+    static std::shared_ptr<const GaborBank> get(double kx, double ky,
+                                                double frequency, int angleInc);
+
+    // Drop every cached bank. Banks still in use stay alive.
+    static void clearCache();
+
+private:
+    GaborBank(int szek, cv::vector<cv::Mat> filters)
+            : szek(szek),
+              filters(std::move(filters)){};
+
+    mutable std::once_flag quantizeOnce;
+    mutable cv::vector<cv::Mat> quantizedFilters;
+
+    static std::shared_ptr<const GaborBank> build(double kx, double ky,
+                                                  double frequency, int angleInc);
+    static cv::vector<cv::Mat> quantize(const cv::vector<cv::Mat> &filters);
+    static void meshgrid(int kernelSize, cv::Mat &meshX, cv::Mat &meshY);
+};
+
+
+#endif
@@ -0,0 +1,65 @@
+// Low level kernels used by the Gabor filtering stage
+
+#ifndef _GABOR_KERNELS_H
+#define _GABOR_KERNELS_H
+
+#include <cstddef>
+
+namespace gabor {
+
+    /*
+     * Windowed dot product between an image patch and a contiguous kernel.
+     *
+     * `window` points to the top-left pixel of the patch and `windowStep` is
+     * the row stride of the image in elements. The kernel is stored row-major
+     * with `kernelCols` elements per row.
+     *
+     * Uses AVX2/FMA or SSE when the compiler targets them, with a scalar
+     * fallback otherwise. No temporary buffer is allocated.
+     */
+    float windowDot(const float *window, size_t windowStep,
+                    const float *kernel, int kernelRows, int kernelCols);
+
+    /*
+     * Fixed point filtering: the normalized image is scaled by
+     * fixedInputScale and clamped to +-fixedInputLimit, so that 8 standard
+     * deviations fit in 13 bits. The taps of the filters are then scaled so
+     * that the response of a window cannot overflow 32 bits.
+     */
+    const float fixedInputScale = 512.0f;
+    const int fixedInputLimit = 4095;
+
+    /*
+     * Same as above on 16 bit pixels and taps, with 32 bit accumulation.
+     * Pairs of products are summed by a single multiply-add instruction
+     * (pmaddwd), which processes twice as many taps per instruction as the
+     * float version.
+     */
+    int windowDot(const short *window, size_t windowStep,
+                  const short *kernel, int kernelRows, int kernelCols);
+
+    /*
+     * Ridge orientation (pi + atan2(sin2theta, cos2theta)) / 2 of `n` pixels
+     * from their doubled angle components, in [0, pi].
+     *
+     * atan2 is evaluated with a degree 11 minimax polynomial, whose absolute
+     * error is below 2e-6 radians (1e-6 on the orientation) plus the float
+     * rounding. atan2(0, 0) gives 0 as std::atan2 does.
+     */
+    void orientationAngles(const float *sin2theta, const float *cos2theta,
+                           float *orientation, int n);
+
+    /*
+     * Same as orientationAngles, but directly writes the index of the closest
+     * orientation among `orientCount` orientations evenly spaced on [0, pi),
+     * i.e. round(orientation / pi * orientCount) modulo orientCount.
+     *
+     * Pixels whose orientation lies within the approximation error of the
+     * middle of two orientations may get the neighbouring index.
+     */
+    void orientationIndices(const float *sin2theta, const float *cos2theta,
+                            unsigned char *index, int n, int orientCount);
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+// Time spent in each stage of the enhancement pipeline
+
+#ifndef _PIPELINE_STATS_H
+#define _PIPELINE_STATS_H
+
+#include <chrono>
+
+struct PipelineStats {
+    typedef std::chrono::steady_clock Clock;
+
+    // Durations in milliseconds. Tiled runs add up the time of every tile.
+    double blur;
+    double normalization;
+    double orientation;
+    double frequency;
+    double filterBank;
+    double gabor;
+    double postProcessing;
+    double total;
+
+    PipelineStats() { reset(); }
+
+    void reset() {
+        blur = normalization = orientation = frequency = 0;
+        filterBank = gabor = postProcessing = total = 0;
+    }
+
+    /*
+     * Add the time elapsed since `start` to `stage` and return the current
+     * time, which is the start of the next stage.
+     */
+    static Clock::time_point lap(double &stage, Clock::time_point start) {
+        Clock::time_point now = Clock::now();
+        stage += std::chrono::duration<double, std::milli>(now - start).count();
+        return now;
+    }
+};
+
+
+#endif
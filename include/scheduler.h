@@ -0,0 +1,94 @@
+// Work-stealing scheduler running a batch of tasks and their parallel loops
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*
+ * Pool of threads, each with its own deque of tasks.
+ *
+ * A thread runs the tasks of its own deque last in, first out, and steals
+ * the oldest task of another deque when its own is empty. The loops of a
+ * running task are split in stripes pushed on the deque of its thread, so
+ * that the threads done with their own tasks help with the large ones.
+ * Threads waiting for their stripes run other tasks meanwhile, which keeps
+ * every thread busy until the whole batch is done.
+ */
+class Scheduler {
+public:
+    // `threadCount` threads, the calling thread of run included.
+    // 0 uses one thread per core.
+    explicit Scheduler(int threadCount = 0);
+    ~Scheduler();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    int threadCount() const { return (int) workers.size(); }
+
+    /*
+     * Run every task and return once they are all done, rethrowing the
+     * first exception thrown by a task. Tasks are started in about the
+     * order they are given. The calling thread takes part in the work.
+     */
+    void run(const cv::vector<std::function<void()>> &tasks);
+
+    /*
+     * Run `body` over `range` split in `stripeCount` stripes, or in a few
+     * stripes per thread when it is 0. Must be called from a task of the
+     * scheduler, see current.
+     */
+    void parallelFor(const cv::Range &range, int stripeCount,
+                     const std::function<void(const cv::Range &)> &body);
+
+    // Scheduler running the task of the calling thread, or nullptr
+    static Scheduler *current();
+
+private:
+    // Tasks forked together, joined by the thread that forked them
+    struct Group {
+        std::atomic<int> pending;
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    struct Task {
+        std::function<void()> body;
+        Group *group;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    cv::vector<std::unique_ptr<Worker>> workers;
+    cv::vector<std::thread> threads;
+
+    // Idle threads sleep until a task is queued, and joining threads until
+    // their group is done as well
+    std::atomic<int> queued;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    bool stopping;
+
+    // The calling thread of run stands for the first worker
+    std::mutex runMutex;
+
+    void fork_join(int worker, const cv::vector<std::function<void()>> &bodies, bool spread);
+    bool pop(int worker, Task &task);
+    void execute(Task &task);
+    void loop(int worker);
+};
+
+
+#endif
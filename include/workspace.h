@@ -0,0 +1,98 @@
+// Buffers reused across the calls of the enhancement pipeline
+
+#ifndef _WORKSPACE_H
+#define _WORKSPACE_H
+
+#include "common.h"
+#include "pipeline_stats.h"
+
+#include <memory>
+#include <mutex>
+
+/*
+ * Intermediate buffers of the enhancement pipeline.
+ *
+ * Buffers keep their memory between calls and are only reallocated when a
+ * larger image is seen, so that a worker processing images of a given size
+ * stops allocating after its first image. A workspace must not be used by
+ * two calls at the same time: keep one per thread.
+ */
+class Workspace {
+public:
+    Workspace() = default;
+    Workspace(const Workspace &) = delete;
+    Workspace &operator=(const Workspace &) = delete;
+
+    // Timings of the last call using the workspace
+    PipelineStats stats;
+
+    // Whole image buffers, in pipeline order
+    cv::Mat colorBlurred;
+    cv::Mat blurred;
+    cv::Mat normalized;
+    cv::Mat orientation;
+    cv::Mat orientindex;
+    cv::Mat fixedInput;
+    cv::Mat tileEnhanced;
+
+    // Local normalization
+    cv::Mat masked;
+    cv::Mat maskUnits;
+    cv::Mat counts;
+    cv::Mat sums;
+    cv::Mat squares;
+
+    // Orientation estimated on a pyramid level
+    cv::Mat coarseSin2theta;
+    cv::Mat coarseCos2theta;
+
+    // Buffers of a band of rows or of a tile processed by one thread
+    struct Band {
+        // Gradients, then the structure tensor, then the doubled angles
+        cv::Mat gradX, gradY, grad_xy;
+        // Doubled angles upsampled from a pyramid level
+        cv::Mat sin2theta, cos2theta;
+
+        cv::vector<int> bucketStart;
+        cv::vector<int> bucketEnd;
+        cv::vector<cv::Point> bucketed;
+        cv::vector<int> bandFilters;
+    };
+
+    // Band borrowed from the workspace, given back when destroyed
+    class Lease {
+    public:
+        Lease(Workspace *workspace, std::unique_ptr<Band> band) : workspace(workspace),
+                                                                band(std::move(band)){};
+        Lease(Lease &&) = default;
+        ~Lease();
+
+        Band *operator->() const { return band.get(); }
+        Band &operator*() const { return *band; }
+
+    private:
+        Workspace *workspace;
+        std::unique_ptr<Band> band;
+    };
+
+    /*
+     * Continuous rows x cols header of the given type over the memory of
+     * `buffer`, which is only reallocated when it is too small. The header
+     * does not own the memory and is invalidated when the buffer grows.
+     */
+    static cv::Mat view(cv::Mat &buffer, int rows, int cols, int type);
+
+    /*
+     * Borrow the buffers of a band. Bands are created on demand, so there are
+     * as many as the largest number of bands used at the same time. This
+     * function is thread-safe.
+     */
+    Lease band();
+
+private:
+    std::mutex bandsMutex;
+    cv::vector<std::unique_ptr<Band>> freeBands;
+};
+
+
+#endif
@@ -1,18 +1,49 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include <string.h>
 #include "fpenhancement.h"
+#include "gabor_bank.h"
+#include "workspace.h"
 #include "common.h"
 #include "ndarray_converter.h"
 
 namespace py = pybind11;
 using namespace pybind11::literals;
 
+// Stage timings in milliseconds, keyed by stage
+static py::dict statsDict(const PipelineStats &stats) {
+    return py::dict("blur"_a = stats.blur,
+                    "normalization"_a = stats.normalization,
+                    "orientation"_a = stats.orientation,
+                    "frequency"_a = stats.frequency,
+                    "filter_bank"_a = stats.filterBank,
+                    "gabor"_a = stats.gabor,
+                    "post_processing"_a = stats.postProcessing,
+                    "total"_a = stats.total);
+}
+
 
 PYBIND11_MODULE(fingerprint, m) {
     NDArrayConverter::init_numpy();
 
     m.doc() = "Finger print extraction";
 
+    m.attr("GABOR_AUTO") = (int) FPEnhancement::GABOR_AUTO;
+    m.attr("GABOR_DIRECT") = (int) FPEnhancement::GABOR_DIRECT;
+    m.attr("GABOR_FFT") = (int) FPEnhancement::GABOR_FFT;
+    m.attr("GABOR_BUCKETED") = (int) FPEnhancement::GABOR_BUCKETED;
+    m.attr("GABOR_BLOCK") = (int) FPEnhancement::GABOR_BLOCK;
+
+    m.def("clear_filter_bank_cache", &GaborBank::clearCache,
+          "Drop the Gabor filter banks cached by the process");
+
+    py::class_<Workspace>(m, "Workspace",
+                          "Buffers reused across calls. Keep one per thread.")
+        .def(py::init<>())
+        .def_property_readonly("stats", [](const Workspace &workspace) {
+            return statsDict(workspace.stats);
+        });
+
     py::class_<FPEnhancement>(m, "Extractor")
         .def(py::init<double, // kx
                       double, // ky
@@ -28,7 +59,18 @@ PYBIND11_MODULE(fingerprint, m) {
                       int,    // blurringTimes
                       int,    // dilationSize
                       int,    // dilationType
-                      bool    // verbose
+                      bool,   // verbose
+                      int,    // gaborBackend
+                      int,    // numThreads
+                      bool,   // estimateFrequency
+                      int,    // gaborBlockSize
+                      double, // maskScale
+                      size_t, // memoryBudget
+                      bool,   // recursiveSmoothing
+                      int,    // orientationScale
+                      int,    // normalizationWindow
+                      bool,   // fixedPoint
+                      int     // angleInc
                       >(),
                       "Constructor",
                       "kx"_a = 0.8,
@@ -45,10 +87,95 @@ PYBIND11_MODULE(fingerprint, m) {
                       "blurring_times"_a = 30,
                       "dilation_size"_a = 10,
                       "dilation_type"_a = 1,
-                      "verbose"_a = false
+                      "verbose"_a = false,
+                      "gabor_backend"_a = (int) FPEnhancement::GABOR_AUTO,
+                      "num_threads"_a = 0,
+                      "estimate_frequency"_a = false,
+                      "gabor_block_size"_a = 16,
+                      "mask_scale"_a = 1.0,
+                      "memory_budget"_a = 0,
+                      "recursive_smoothing"_a = false,
+                      "orientation_scale"_a = 1,
+                      "normalization_window"_a = 0,
+                      "fixed_point"_a = false,
+                      "angle_inc"_a = 3
                       )
-        .def("extract_fingerprints", &FPEnhancement::extractFingerPrints)
-        .def("post_processing", &FPEnhancement::postProcessingFilter);
+        .def("extract_fingerprints",
+             (cv::Mat (FPEnhancement::*)(const cv::Mat &) const) &FPEnhancement::extractFingerPrints)
+        .def("extract_fingerprints",
+             [](const FPEnhancement &self, const cv::Mat &inputImage, Workspace &workspace) {
+                 // The result is handed to numpy, so it is not reused
+                 cv::Mat enhancedImage;
+                 self.extractFingerPrints(inputImage, enhancedImage, workspace);
+                 return enhancedImage;
+             },
+             "input_image"_a, "workspace"_a)
+        .def("post_processing", &FPEnhancement::postProcessingFilter)
+        .def("extract_masked_fingerprints", &FPEnhancement::extractMaskedFingerPrints)
+        .def("orientation_field", &FPEnhancement::orientationField)
+        .def("extract_batch", &FPEnhancement::extractBatch, "input_images"_a)
+        .def("extract_masked_batch", &FPEnhancement::extractMaskedBatch, "input_images"_a)
+        .def("enhance",
+             [](const FPEnhancement &self, const cv::Mat &inputImage, bool orientation, bool coherence,
+                bool frequency, bool mask, bool masked) {
+                 int outputs = (orientation ? FPEnhancement::OUTPUT_ORIENTATION : 0) |
+                               (coherence ? FPEnhancement::OUTPUT_COHERENCE : 0) |
+                               (frequency ? FPEnhancement::OUTPUT_FREQUENCY : 0) |
+                               (mask ? FPEnhancement::OUTPUT_MASK : 0);
+                 FPEnhancement::EnhancementResult result = self.enhance(inputImage, outputs, masked);
+
+                 py::dict fields("enhanced"_a = result.enhanced, "stats"_a = statsDict(result.stats));
+                 if (orientation) {
+                     fields["orientation"] = result.orientation;
+                 }
+                 if (coherence) {
+                     fields["coherence"] = result.coherence;
+                 }
+                 if (frequency) {
+                     fields["frequency"] = result.frequency;
+                 }
+                 if (mask) {
+                     fields["mask"] = result.mask;
+                 }
+                 return fields;
+             },
+             "Enhanced image and the requested fields, as a dict of arrays",
+             "input_image"_a, "orientation"_a = false, "coherence"_a = false,
+             "frequency"_a = false, "mask"_a = false, "masked"_a = false)
+        .def("sweep",
+             [](const FPEnhancement &self, const cv::Mat &inputImage, const py::list &grid) {
+                 // Keys missing from a point keep the value of the extractor
+                 cv::vector<FPEnhancement::SweepPoint> points;
+                 for (const py::handle &item : grid) {
+                     if (!py::isinstance<py::dict>(item)) {
+                         throw py::type_error("Each point of the grid must be a dict of parameters");
+                     }
+                     py::dict parameters = py::reinterpret_borrow<py::dict>(item);
+                     FPEnhancement::SweepPoint point = self.sweepPoint();
+                     auto read = [&](const char *key, double &value) {
+                         if (parameters.contains(key)) {
+                             value = parameters[key].cast<double>();
+                         }
+                     };
+                     read("kx", point.kx);
+                     read("ky", point.ky);
+                     read("block_sigma", point.blockSigma);
+                     read("gradient_sigma", point.gradientSigma);
+                     read("orient_smooth_sigma", point.orientSmoothSigma);
+                     read("freq_value", point.freqValue);
+                     points.push_back(point);
+                 }
+                 return self.sweep(inputImage, points);
+             },
+             "Enhance the image for each dict of parameters of the grid, sharing the common stages",
+             "input_image"_a, "grid"_a)
+        .def("last_stats", [](const FPEnhancement &self) { return statsDict(self.lastStats()); },
+             "Time in milliseconds spent in each stage by the last extraction")
+        .def_static("pack_ridge_map", &FPEnhancement::packRidgeMap,
+                    "Pack a ridge map into 1 bit per pixel, as numpy.packbits(axis=1)")
+        .def_static("unpack_ridge_map", &FPEnhancement::unpackRidgeMap,
+                    "Unpack a ridge map packed by pack_ridge_map",
+                    "packed"_a, "cols"_a);
 }
 
 
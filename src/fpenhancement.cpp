@@ -6,12 +6,68 @@
 //    git@jjerphan.xyz
 
 #include "fpenhancement.h"
+#include "gabor_bank.h"
+#include "gabor_kernels.h"
+#include "scheduler.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <map>
+#include <numeric>
+#include <tuple>
 
 // see : https://docs.opencv.org/3.4/df/d4e/group__imgproc__c.html
 #define CV_RGB2GRAY 7
 
+// Height of the bands of rows processed by the Gabor filtering. It bounds
+// the size of the orientation buckets while keeping them large enough for
+// each filter to be reused many times.
+static const int gaborBandHeight = 32;
+
+// Size of the blocks used for the ridge frequency estimation
+static const int freqBlockSize = 38;
+
+// Minimal and maximal ridge period allowed by the frequency estimation,
+// in pixels
+static const double minWaveLength = 5;
+static const double maxWaveLength = 15;
+
+// Estimation of the peak memory used by the pipeline per pixel, i.e. about
+// sixteen float images alive at the same time
+static const size_t pipelineBytesPerPixel = 16 * sizeof(float);
+
+// Scratch memory of the concurrent stripes of the FFT backend when there is
+// no memory budget
+static const size_t fftScratchBudget = (size_t) 512 << 20;
+
+// Smallest tile interior used when the memory budget is too small
+static const int minTileSize = 64;
+
+// Largest radius of the local normalization whose window sums of squared
+// 8 bits pixels fit in 32 bits
+static const int maxIntegerNormalizationRadius = 128;
+
+// Height of the bands of rows of the integral images built in parallel
+static const int integralBandHeight = 64;
+
+// Floor of the local variance of the normalization, in squared grey levels
+static const double minLocalVariance = 1.0;
+
+// Working memory of a tile of the orientation estimation, which is meant to
+// stay in a per-core L2 cache
+static const size_t orientTileBudget = (size_t) 1 << 20;
+
+// Smallest side of the interior of the tiles of the orientation estimation
+static const int minOrientTileSize = 16;
+
+// Support of the recursive Gaussian when it is truncated, in sigmas
+static const double recursiveHaloSigmas = 4.0;
+
+// Below this sigma, the separable Gaussian kernel is cheaper and more
+// accurate than the recursive filter
+static const double recursiveMinSigma = 2.0;
+
 namespace cv {
     using std::vector;
 }
@@ -20,247 +76,1460 @@ namespace cv {
  * Perform Gabor filter based image enhancement using orientation field and
  * frequency.
  */
-cv::Mat FPEnhancement::extractFingerPrints(const cv::Mat &inputImage) {
-    // Perform median blurring to smooth the image
-    cv::Mat blurredImage;
-    medianBlur(inputImage, blurredImage, 3);
+cv::Mat FPEnhancement::extractFingerPrints(const cv::Mat &inputImage) const {
+    Workspace workspace;
+    cv::Mat enhancedImage;
+    extractFingerPrints(inputImage, enhancedImage, workspace);
+
+    return enhancedImage;
+}
+
+/*
+ * Same as above, with the intermediate buffers taken from `workspace` and
+ * the result written to `enhancedImage`, which are both reused when they
+ * are large enough.
+ */
+void FPEnhancement::extractFingerPrints(const cv::Mat &inputImage, cv::Mat &enhancedImage,
+                                        Workspace &workspace) const {
+    workspace.stats.reset();
+    PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
+
+    int szek;
+    enhance_image(inputImage, cv::Mat(), workspace, enhancedImage, szek);
+
+    if (addBorder) {
+        add_border(enhancedImage, szek);
+    }
+
+    PipelineStats::lap(workspace.stats.total, start);
+    publish_stats(workspace.stats);
+}
+
+/*
+ * Perform the enhancement on the foreground only.
+ *
+ * The foreground mask of postProcessingFilter is computed first, possibly at
+ * a reduced resolution (see maskScale). The pipeline then only runs on the
+ * bounding box of the mask: the normalization statistics only account for
+ * the masked pixels, and the Gabor filters are only evaluated on them.
+ *
+ * The bounding box is extended by the halo of the tiled pipeline, so the
+ * result is the same as masking the output of extractFingerPrints with
+ * postProcessingFilter, up to the global normalization statistics and the
+ * frequency given to the blocks without a reliable estimate.
+ */
+cv::Mat FPEnhancement::extractMaskedFingerPrints(const cv::Mat &inputImage) const {
+    return enhance(inputImage, 0, true).enhanced;
+}
+
+/*
+ * Enhance the image, and return the intermediate fields selected by the
+ * EnhancementOutput flags of `outputs` along with the result. The fields
+ * are the ones used by the pipeline, so nothing is computed twice.
+ *
+ * With `masked`, only the foreground is enhanced, as in
+ * extractMaskedFingerPrints, and the fields are 0 outside of the bounding
+ * box of the foreground.
+ */
+FPEnhancement::EnhancementResult FPEnhancement::enhance(const cv::Mat &inputImage, int outputs,
+                                                        bool masked) const {
+    Workspace workspace;
+    return enhance(inputImage, outputs, masked, workspace);
+}
+
+/*
+ * Same as above, with the intermediate buffers taken from `workspace`.
+ */
+FPEnhancement::EnhancementResult FPEnhancement::enhance(const cv::Mat &inputImage, int outputs,
+                                                        bool masked, Workspace &workspace) const {
+    EnhancementResult result;
+    PipelineStats &stats = workspace.stats;
+    stats.reset();
+    PipelineStats::Clock::time_point begin = PipelineStats::Clock::now();
+
+    cv::Size size = inputImage.size();
+    cv::Rect box(0, 0, size.width, size.height);
+    cv::Mat mask;
+
+    if (masked || (outputs & OUTPUT_MASK)) {
+        mask = foreground_mask(inputImage, maskScale);
+        PipelineStats::lap(stats.postProcessing, begin);
+
+        if (outputs & OUTPUT_MASK) {
+            result.mask = mask;
+        }
+    }
+
+    if (masked) {
+        cv::Mat foreground;
+        cv::findNonZero(mask, foreground);
+        if (foreground.empty()) {
+            box = cv::Rect();
+        } else {
+            // Keep a margin so that every stage of the pixels at the border
+            // of the mask only reads pixels of the processed region, as for
+            // the halo of the tiles
+            int margin = pipeline_halo();
+
+            box = cv::boundingRect(foreground);
+            box = cv::Rect(box.x - margin, box.y - margin,
+                           box.width + 2 * margin, box.height + 2 * margin) &
+                  cv::Rect(0, 0, size.width, size.height);
+        }
+
+        if (verbose)
+            std::cout << "Foreground: " << box.width << "x" << box.height << " at ("
+                      << box.x << ", " << box.y << ")" << std::endl;
+    }
+
+    int szek = 0;
+    cv::Mat boxMask = masked && box.area() > 0 ? mask(box) : cv::Mat();
+    cv::Mat boxResult;
+    EnhancementResult boxFields;
+
+    if (box.area() > 0) {
+        enhance_image(inputImage(box), boxMask, workspace, boxResult, szek, outputs, &boxFields);
+    }
+
+    // Bring the results of the box back to the size of the image
+    cv::Rect boxInBox(0, 0, box.width, box.height);
+    place(boxFields.orientation, box, boxInBox, size, result.orientation);
+    place(boxFields.coherence, box, boxInBox, size, result.coherence);
+    place(boxFields.frequency, box, boxInBox, size, result.frequency);
+
+    if (!masked) {
+        result.enhanced = boxResult;
+        if (addBorder) {
+            add_border(result.enhanced, szek);
+        }
+    } else if (!addBorder || box.area() == 0) {
+        result.enhanced = cv::Mat::zeros(size, CV_8UC1);
+        if (box.area() > 0) {
+            boxResult.copyTo(result.enhanced(box), boxMask);
+        }
+    } else {
+        // The border is drawn on the whole image, then masked
+        cv::Mat borderedImage = cv::Mat::zeros(size, CV_8UC1);
+        boxResult.copyTo(borderedImage(box));
+        add_border(borderedImage, szek);
+        result.enhanced = cv::Mat::zeros(size, CV_8UC1);
+        borderedImage.copyTo(result.enhanced, mask);
+    }
+
+    PipelineStats::lap(stats.total, begin);
+    publish_stats(stats);
+    result.stats = stats;
+
+    return result;
+}
+
+/*
+ * Enhance every image of `inputImages` with extractFingerPrints.
+ *
+ * Images are run concurrently on a work-stealing scheduler of numThreads
+ * threads, and the row bands of each image are split in tasks as well. The
+ * largest images are started first, and the threads running out of images
+ * steal the bands of the ones still running, so that a batch mixing a large
+ * image with small ones keeps every thread busy until the end.
+ */
+cv::vector<cv::Mat> FPEnhancement::extractBatch(const cv::vector<cv::Mat> &inputImages) const {
+    return extract_batch(inputImages, false);
+}
+
+/*
+ * Same as above with extractMaskedFingerPrints.
+ */
+cv::vector<cv::Mat> FPEnhancement::extractMaskedBatch(const cv::vector<cv::Mat> &inputImages) const {
+    return extract_batch(inputImages, true);
+}
+
+cv::vector<cv::Mat> FPEnhancement::extract_batch(const cv::vector<cv::Mat> &inputImages,
+                                                 bool masked) const {
+    cv::vector<cv::Mat> enhancedImages(inputImages.size());
+
+    std::vector<size_t> order(inputImages.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return inputImages[a].total() > inputImages[b].total();
+    });
+
+    // A thread waiting for the bands of its image may start another image
+    // meanwhile, so workspaces are handed out per image rather than per thread
+    std::mutex workspacesMutex;
+    cv::vector<std::unique_ptr<Workspace>> workspaces;
+
+    cv::vector<std::function<void()>> tasks;
+    tasks.reserve(order.size());
+    for (size_t i : order) {
+        tasks.push_back([&, i]() {
+            std::unique_ptr<Workspace> workspace;
+            {
+                std::lock_guard<std::mutex> lock(workspacesMutex);
+                if (!workspaces.empty()) {
+                    workspace = std::move(workspaces.back());
+                    workspaces.pop_back();
+                }
+            }
+            if (!workspace) {
+                workspace.reset(new Workspace());
+            }
+
+            if (masked) {
+                enhancedImages[i] = enhance(inputImages[i], 0, true, *workspace).enhanced;
+            } else {
+                extractFingerPrints(inputImages[i], enhancedImages[i], *workspace);
+            }
+
+            std::lock_guard<std::mutex> lock(workspacesMutex);
+            workspaces.push_back(std::move(workspace));
+        });
+    }
+
+    Scheduler scheduler(numThreads);
+    scheduler.run(tasks);
+
+    return enhancedImages;
+}
+
+/*
+ * Copy the `part` region of a field computed on a region of the image to
+ * the `region` of the field of the whole image, which is created with
+ * zeros the first time. Empty fields are skipped.
+ */
+void FPEnhancement::place(const cv::Mat &field, const cv::Rect &region, const cv::Rect &part,
+                          const cv::Size &size, cv::Mat &wholeField) {
+    if (field.empty()) {
+        return;
+    }
+
+    // A field of the whole image is kept as is
+    if (wholeField.empty() && region.size() == size) {
+        wholeField = field(part);
+        return;
+    }
+
+    if (wholeField.empty()) {
+        wholeField = cv::Mat::zeros(size, field.type());
+    }
+
+    field(part).copyTo(wholeField(region));
+}
+
+FPEnhancement::Parameters FPEnhancement::parameters() const {
+    Parameters p;
+    p.kx = kx;
+    p.ky = ky;
+    p.blockSigma = blockSigma;
+    p.gradientSigma = gradientSigma;
+    p.orientSmoothSigma = orientSmoothSigma;
+    p.freqValue = freqValue;
+    p.ddepth = ddepth;
+    p.addBorder = addBorder;
+    p.cannyLowThreshold = cannyLowThreshold;
+    p.cannyRatio = cannyRatio;
+    p.kernelSize = kernelSize;
+    p.blurringTimes = blurringTimes;
+    p.dilationSize = dilationSize;
+    p.dilationType = dilationType;
+    p.verbose = verbose;
+    p.gaborBackend = gaborBackend;
+    p.numThreads = numThreads;
+    p.estimateFrequency = estimateFrequency;
+    p.gaborBlockSize = gaborBlockSize;
+    p.maskScale = maskScale;
+    p.memoryBudget = memoryBudget;
+    p.recursiveSmoothing = recursiveSmoothing;
+    p.orientationScale = orientationScale;
+    p.normalizationWindow = normalizationWindow;
+    p.fixedPoint = fixedPoint;
+    p.angleInc = angleInc;
+    return p;
+}
+
+FPEnhancement::SweepPoint FPEnhancement::sweepPoint() const {
+    SweepPoint point;
+    point.kx = kx;
+    point.ky = ky;
+    point.blockSigma = blockSigma;
+    point.gradientSigma = gradientSigma;
+    point.orientSmoothSigma = orientSmoothSigma;
+    point.freqValue = freqValue;
+    return point;
+}
+
+/*
+ * Run extractFingerPrints for every parameter set of `points`.
+ *
+ * The stages are planned according to the parameters they depend on: the
+ * blur and the normalization run once, the orientation once per distinct
+ * triple of sigmas, the estimated frequency once per distinct triple of
+ * sigmas and freqValue, which is its fallback when no block has a valid
+ * frequency, and the Gabor filtering once per distinct point. Orientations,
+ * frequencies, then Gabor filterings, run in parallel.
+ * Filter banks are shared through the bank cache. The sweep is never tiled.
+ */
+cv::vector<cv::Mat> FPEnhancement::sweep(const cv::Mat &inputImage,
+                                         const cv::vector<SweepPoint> &points) const {
+    typedef std::tuple<double, double, double> SigmaKey;
+    typedef std::tuple<int, double> FrequencyKey;
+    typedef std::tuple<double, double, double, double, double, double> PointKey;
+
+    // Distinct sigmas, frequencies and points, the first point of each, and
+    // the run of each point
+    std::map<SigmaKey, int> sigmaIndex;
+    std::map<FrequencyKey, int> frequencyIndex;
+    std::map<PointKey, int> pointIndex;
+    cv::vector<int> pointOfSigma;
+    cv::vector<int> pointOfFrequency;
+    cv::vector<int> sigmaOfFrequency;
+    cv::vector<int> frequencyOfRun;
+    cv::vector<int> sigmaOfRun;
+    cv::vector<int> pointOfRun;
+    cv::vector<int> runOfPoint(points.size());
+
+    for (size_t p = 0; p < points.size(); p++) {
+        const SweepPoint &point = points[p];
+        SigmaKey sigmaKey(point.blockSigma, point.gradientSigma, point.orientSmoothSigma);
+        PointKey pointKey(point.kx, point.ky, point.blockSigma, point.gradientSigma,
+                          point.orientSmoothSigma, point.freqValue);
+
+        auto sigma = sigmaIndex.insert(std::make_pair(sigmaKey, (int) sigmaIndex.size()));
+        if (sigma.second) {
+            pointOfSigma.push_back(p);
+        }
+
+        // Without estimation, the frequency is freqValue and is not a stage
+        FrequencyKey frequencyKey(sigma.first->second, estimateFrequency ? point.freqValue : 0);
+        auto frequency = frequencyIndex.insert(std::make_pair(frequencyKey, (int) frequencyIndex.size()));
+        if (frequency.second) {
+            pointOfFrequency.push_back(p);
+            sigmaOfFrequency.push_back(sigma.first->second);
+        }
+
+        auto run = pointIndex.insert(std::make_pair(pointKey, (int) pointIndex.size()));
+        if (run.second) {
+            frequencyOfRun.push_back(frequency.first->second);
+            sigmaOfRun.push_back(sigma.first->second);
+            pointOfRun.push_back(p);
+        }
+        runOfPoint[p] = run.first->second;
+    }
+
+    if (verbose)
+        std::cout << "Sweep: " << points.size() << " points, " << pointOfSigma.size()
+                  << " orientations, " << (estimateFrequency ? pointOfFrequency.size() : 0)
+                  << " frequency estimations, " << pointOfRun.size() << " Gabor filterings" << std::endl;
+
+    // Shared first stages
+    Workspace workspace;
+    cv::Mat normalizedImage = normalize_blurred(blurred_grey(inputImage, workspace), cv::Mat(), workspace);
+
+    bool indexed = !estimateFrequency && gaborBackend != GABOR_BLOCK;
+    cv::vector<cv::Mat> orientations(pointOfSigma.size());
+    cv::vector<cv::Mat> frequencies(pointOfFrequency.size());
+
+    run_parallel(cv::Range(0, pointOfSigma.size()), [&](const cv::Range &range) {
+        Workspace sigmaWorkspace;
+        for (int k = range.start; k < range.end; k++) {
+            std::unique_ptr<const FPEnhancement> variant = with_parameters(points[pointOfSigma[k]]);
+
+            // The orientation lives in the workspace, so it is copied
+            variant->orient_ridge(normalizedImage, sigmaWorkspace, nullptr, indexed).copyTo(orientations[k]);
+        }
+    });
+
+    if (estimateFrequency) {
+        run_parallel(cv::Range(0, pointOfFrequency.size()), [&](const cv::Range &range) {
+            for (int f = range.start; f < range.end; f++) {
+                std::unique_ptr<const FPEnhancement> variant = with_parameters(points[pointOfFrequency[f]]);
+                frequencies[f] = variant->ridge_freq(normalizedImage, orientations[sigmaOfFrequency[f]]);
+            }
+        });
+    }
+
+    cv::vector<cv::Mat> results(pointOfRun.size());
+
+    run_parallel(cv::Range(0, pointOfRun.size()), [&](const cv::Range &range) {
+        Workspace runWorkspace;
+        for (int run = range.start; run < range.end; run++) {
+            std::unique_ptr<const FPEnhancement> variant = with_parameters(points[pointOfRun[run]]);
+            int k = sigmaOfRun[run];
+            int f = frequencyOfRun[run];
+
+            int szek;
+            variant->filter_ridge(normalizedImage, orientations[k], frequencies[f], cv::Mat(),
+                                  runWorkspace, results[run], &szek);
+            if (addBorder) {
+                add_border(results[run], szek);
+            }
+        }
+    });
+
+    // Points with the same parameters share their result
+    cv::vector<cv::Mat> enhancedImages(points.size());
+    for (size_t p = 0; p < points.size(); p++) {
+        enhancedImages[p] = results[runOfPoint[p]];
+    }
+
+    return enhancedImages;
+}
+
+/*
+ * Extractor with the parameters of `point`, and the other ones of this one.
+ */
+std::unique_ptr<const FPEnhancement> FPEnhancement::with_parameters(const SweepPoint &point) const {
+    Parameters p = parameters();
+    p.kx = point.kx;
+    p.ky = point.ky;
+    p.blockSigma = point.blockSigma;
+    p.gradientSigma = point.gradientSigma;
+    p.orientSmoothSigma = point.orientSmoothSigma;
+    p.freqValue = point.freqValue;
+    p.verbose = false;
+
+    return std::unique_ptr<const FPEnhancement>(new FPEnhancement(p));
+}
+
+/*
+ * Timings of the last extraction that completed, from any thread.
+ */
+PipelineStats FPEnhancement::lastStats() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return publishedStats;
+}
+
+void FPEnhancement::publish_stats(const PipelineStats &stats) const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    publishedStats = stats;
+}
+
+/*
+ * Orientation field computed by the pipeline, in radians in [0, pi].
+ */
+cv::Mat FPEnhancement::orientationField(const cv::Mat &inputImage) const {
+    Workspace workspace;
+    cv::Mat normalizedImage = normalize_blurred(blurred_grey(inputImage, workspace), cv::Mat(), workspace);
+
+    // The result must not be a buffer of the workspace
+    cv::Mat orientationImage;
+    orient_ridge(normalizedImage, workspace, nullptr, false).copyTo(orientationImage);
+    return orientationImage;
+}
 
-    // Check whether the input image is grayscale.
-    // If not, convert it to grayscale.
-    if (blurredImage.channels() != 1) {
-        cvtColor(blurredImage, blurredImage, CV_RGB2GRAY);
+/*
+ * Enhancement pipeline. If `mask` is not empty, the normalization and the
+ * filtering only account for its non-zero pixels.
+ *
+ * The result is written to `enhancedImage`, and the half size of the
+ * largest Gabor filter is stored in `szek`.
+ */
+void FPEnhancement::enhance_image(const cv::Mat &inputImage, const cv::Mat &mask,
+                                  Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                                  int outputs, EnhancementResult *fields) const {
+    // Bound the memory used by the pipeline by running it tile by tile
+    if (memoryBudget > 0 &&
+        pipelineBytesPerPixel * inputImage.total() > memoryBudget) {
+        enhance_tiled(inputImage, mask, workspace, enhancedImage, szek, outputs, fields);
+        return;
     }
 
+    PipelineStats &stats = workspace.stats;
+    PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
+
+    // Perform median blurring to smooth the image, and convert it to
+    // grayscale if needed
+    cv::Mat blurredImage = blurred_grey(inputImage, workspace);
+    start = PipelineStats::lap(stats.blur, start);
+
     if (verbose)
         std::cout << "Rows: " << blurredImage.rows << " / Cols: " << blurredImage.cols
                   << std::endl;
 
     // Perform normalization using the method provided in the paper
-    cv::Mat normalizedImage = FPEnhancement::normalize_image(blurredImage, 0, 1);
+    cv::Mat normalizedImage = normalize_blurred(blurredImage, mask, workspace);
+    PipelineStats::lap(stats.normalization, start);
 
     if (verbose)
         std::cout << "Normalization done" << std::endl;
 
-    // Calculate ridge orientation field
-    cv::Mat orientationImage = this->orient_ridge(normalizedImage);
+    enhance_normalized(normalizedImage, mask, workspace, enhancedImage, szek, outputs, fields);
+}
+
+/*
+ * Second part of the pipeline, starting from the normalized image.
+ *
+ * The fields selected by `outputs` are stored in `fields`, if given.
+ */
+void FPEnhancement::enhance_normalized(const cv::Mat &normalizedImage, const cv::Mat &mask,
+                                       Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                                       int outputs, EnhancementResult *fields) const {
+    if (!fields) {
+        outputs = 0;
+    }
+
+    // Calculate ridge orientation field. The filtering only needs the index
+    // of the filter orientation, unless the angles are used by the frequency
+    // estimation, the block backend or the caller.
+    bool indexed = !estimateFrequency && gaborBackend != GABOR_BLOCK && !(outputs & OUTPUT_ORIENTATION);
+    PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
+    cv::Mat coherence;
+    cv::Mat orientationImage = this->orient_ridge(normalizedImage, workspace,
+                                                  (outputs & OUTPUT_COHERENCE) ? &coherence : nullptr,
+                                                  indexed);
+    start = PipelineStats::lap(workspace.stats.orientation, start);
+
+    // The orientation lives in the workspace, so it is copied
+    if (outputs & OUTPUT_ORIENTATION) {
+        orientationImage.convertTo(fields->orientation, CV_32FC1);
+    }
+    if (outputs & OUTPUT_COHERENCE) {
+        fields->coherence = coherence;
+    }
 
     if (verbose)
         std::cout << "Orientation done" << std::endl;
 
-    cv::Mat freq = cv::Mat::ones(normalizedImage.rows, normalizedImage.cols,
-                                 normalizedImage.type()) *
-                   freqValue;
+    // Block-wise ridge frequency, or freqValue everywhere
+    cv::Mat freq;
+    if (estimateFrequency) {
+        freq = ridge_freq(normalizedImage, orientationImage);
+        PipelineStats::lap(workspace.stats.frequency, start);
 
-    // Get the final enhanced image and return it as result
-    cv::Mat enhancedImage =
-            this->filter_ridge(normalizedImage, orientationImage, freq);
+        if (verbose)
+            std::cout << "Frequency done" << std::endl;
+    }
+
+    // Frequency of each pixel, from its block or freqValue
+    if (outputs & OUTPUT_FREQUENCY) {
+        int rows = normalizedImage.rows;
+        int cols = normalizedImage.cols;
+
+        if (freq.empty()) {
+            fields->frequency = cv::Mat(rows, cols, CV_32FC1, cv::Scalar::all(freqValue));
+        } else {
+            cv::Mat expanded;
+            cv::resize(freq, expanded, cv::Size(freq.cols * freqBlockSize, freq.rows * freqBlockSize),
+                       0, 0, cv::INTER_NEAREST);
+            expanded(cv::Rect(0, 0, cols, rows)).copyTo(fields->frequency);
+        }
+    }
+
+    // Get the final enhanced image
+    this->filter_ridge(normalizedImage, orientationImage, freq, mask, workspace, enhancedImage, &szek);
 
     if (verbose)
         std::cout << "Done with processing pipeling" << std::endl;
+}
 
-    return enhancedImage;
+/*
+ * Run the pipeline on overlapping tiles so that the float intermediates
+ * never exceed memoryBudget bytes.
+ *
+ * Each tile is extended with a halo covering the support of every stage:
+ * the median blur, the chain of orientation smoothings and the Gabor
+ * window. Interior pixels thus get the same result as with the untiled
+ * pipeline, and only the interiors are stitched into the output. The
+ * normalization statistics are computed on the whole image beforehand.
+ *
+ * When the frequency is estimated, tiles are aligned on the frequency
+ * blocks, but blocks without a reliable frequency get the median of their
+ * own tile. With recursiveSmoothing, the halo only covers the 3 sigma
+ * support of the recursive Gaussians, so the stitching is approximate.
+ */
+void FPEnhancement::enhance_tiled(const cv::Mat &inputImage, const cv::Mat &mask,
+                                  Workspace &workspace, cv::Mat &enhancedImage, int &szek,
+                                  int outputs, EnhancementResult *fields) const {
+    cv::Rect image(0, 0, inputImage.cols, inputImage.rows);
+
+    szek = GaborBank::get(kx, ky, freqValue, angleInc)->szek;
+
+    // Tiles are aligned on the frequency blocks and on the pyramid grid of
+    // the orientation estimation
+    int alignment = estimateFrequency ? freqBlockSize : 1;
+    while (alignment % orientationScale != 0) {
+        alignment *= 2;
+    }
+
+    int halo = pipeline_halo();
+    halo = (halo + alignment - 1) / alignment * alignment;
+
+    // Largest tile whose extended size fits in the budget
+    int tileSize = (int) std::sqrt((double) memoryBudget / pipelineBytesPerPixel) - 2 * halo;
+    if (tileSize < minTileSize) {
+        tileSize = minTileSize;
+        if (verbose)
+            std::cout << "Memory budget too small, using " << tileSize << " pixels tiles"
+                      << std::endl;
+    }
+    tileSize = std::max(tileSize / alignment, 1) * alignment;
+
+    int tileRows = (inputImage.rows + tileSize - 1) / tileSize;
+    int tileCols = (inputImage.cols + tileSize - 1) / tileSize;
+
+    if (verbose)
+        std::cout << "Tiling: " << tileRows << "x" << tileCols << " tiles of " << tileSize
+                  << " pixels with a halo of " << halo << std::endl;
+
+    // Normalization statistics of the whole image, computed on the interior
+    // of each tile. The local normalization is done on each tile instead.
+    double sum = 0;
+    double sumSquares = 0;
+    double count = 0;
+
+    for (int ty = 0; ty < (normalizationWindow > 0 ? 0 : tileRows); ty++) {
+        for (int tx = 0; tx < tileCols; tx++) {
+            cv::Rect inner = cv::Rect(tx * tileSize, ty * tileSize, tileSize, tileSize) & image;
+            cv::Rect outer = cv::Rect(inner.x - 1, inner.y - 1, inner.width + 2, inner.height + 2) & image;
+
+            PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
+            cv::Mat blurredTile = blurred_grey(inputImage(outer), workspace);
+            start = PipelineStats::lap(workspace.stats.blur, start);
+            cv::Rect innerInTile(inner.x - outer.x, inner.y - outer.y, inner.width, inner.height);
+
+            accumulate_statistics(blurredTile(innerInTile), mask.empty() ? cv::Mat() : mask(inner),
+                                  sum, sumSquares, count);
+            PipelineStats::lap(workspace.stats.normalization, start);
+        }
+    }
+
+    double mean, stdDev;
+    mean_deviation(sum, sumSquares, count, mean, stdDev);
+
+    if (verbose)
+        std::cout << "Normalization statistics done" << std::endl;
+
+    enhancedImage.create(inputImage.rows, inputImage.cols, CV_8UC1);
+    enhancedImage.setTo(0);
+
+    for (int ty = 0; ty < tileRows; ty++) {
+        for (int tx = 0; tx < tileCols; tx++) {
+            cv::Rect inner = cv::Rect(tx * tileSize, ty * tileSize, tileSize, tileSize) & image;
+            cv::Rect outer = cv::Rect(inner.x - halo, inner.y - halo,
+                                      inner.width + 2 * halo, inner.height + 2 * halo) &
+                             image;
+
+            PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
+            cv::Mat blurredTile = blurred_grey(inputImage(outer), workspace);
+            cv::Mat tileMask = mask.empty() ? cv::Mat() : mask(outer);
+            start = PipelineStats::lap(workspace.stats.blur, start);
+
+            // Same normalization as normalize_image, with the global statistics
+            cv::Mat normalizedTile;
+            if (normalizationWindow > 0) {
+                normalizedTile = local_normalize(blurredTile, tileMask, workspace);
+            } else {
+                double scale = stdDev > 0 ? 1 / stdDev : 0;
+                normalizedTile = Workspace::view(workspace.normalized, outer.height, outer.width, CV_32FC1);
+                blurredTile.convertTo(normalizedTile, CV_32FC1, scale, -mean * scale);
+            }
+            PipelineStats::lap(workspace.stats.normalization, start);
+
+            int tileSzek;
+            cv::Mat enhancedTile = Workspace::view(workspace.tileEnhanced, outer.height, outer.width, CV_8UC1);
+            EnhancementResult tileFields;
+            enhance_normalized(normalizedTile, tileMask, workspace, enhancedTile, tileSzek, outputs,
+                               fields ? &tileFields : nullptr);
+            szek = std::max(szek, tileSzek);
+
+            cv::Rect innerInTile(inner.x - outer.x, inner.y - outer.y, inner.width, inner.height);
+            enhancedTile(innerInTile).copyTo(enhancedImage(inner));
+
+            if (fields) {
+                place(tileFields.orientation, inner, innerInTile, inputImage.size(), fields->orientation);
+                place(tileFields.coherence, inner, innerInTile, inputImage.size(), fields->coherence);
+                place(tileFields.frequency, inner, innerInTile, inputImage.size(), fields->frequency);
+            }
+        }
+    }
+}
+
+/*
+ * Median blurred, grayscale version of the image, stored in the workspace.
+ */
+cv::Mat FPEnhancement::blurred_grey(const cv::Mat &inputImage, Workspace &workspace) {
+    int rows = inputImage.rows;
+    int cols = inputImage.cols;
+
+    if (inputImage.channels() == 1) {
+        cv::Mat blurredImage = Workspace::view(workspace.blurred, rows, cols, inputImage.type());
+        medianBlur(inputImage, blurredImage, 3);
+        return blurredImage;
+    }
+
+    cv::Mat colorBlurred = Workspace::view(workspace.colorBlurred, rows, cols, inputImage.type());
+    medianBlur(inputImage, colorBlurred, 3);
+
+    cv::Mat blurredImage = Workspace::view(workspace.blurred, rows, cols, CV_MAKETYPE(inputImage.depth(), 1));
+    cvtColor(colorBlurred, blurredImage, CV_RGB2GRAY);
+    return blurredImage;
+}
+
+/*
+ * Distance up to which a pixel of the enhanced image depends on the input
+ * image: the Gabor window, estimated frequencies possibly needing the
+ * window of the longest ridge period, or the support of the orientation,
+ * plus the window of the local normalization.
+ */
+int FPEnhancement::pipeline_halo() const {
+    int haloSzek = GaborBank::get(kx, ky, freqValue, angleInc)->szek;
+    if (estimateFrequency) {
+        haloSzek = std::max(haloSzek, GaborBank::get(kx, ky, 1 / maxWaveLength, angleInc)->szek);
+    }
+
+    return std::max(haloSzek + 2, orientation_halo()) + 1 + normalizationWindow / 2;
+}
+
+/*
+ * Distance up to which a pixel of the orientation field depends on the
+ * normalized image, i.e. the sum of the radii of the gradient, block and
+ * orientation smoothing kernels of orient_ridge, scaled by the pyramid level.
+ */
+int FPEnhancement::orientation_halo() const {
+    int scale = orientationScale;
+    int radii = smoothing_size(std::max(gradientSigma / scale, 0.5)) / 2 +
+                smoothing_radius(blockSigma / scale) +
+                smoothing_radius(orientSmoothSigma / scale);
+
+    // At coarse levels, add the support of the pyramid and of the upsampling
+    return scale == 1 ? radii + 3 : scale * (radii + 3) + 2 * scale;
 }
 
 /*
  * Normalization function of Anil Jain's algorithm.
+ *
+ * The mean and the standard deviation are computed in a single pass, and
+ * the normalized float image is written by a second one to
+ * `normalizedImage`. An image with no variance is mapped to reqMean.
  */
-cv::Mat FPEnhancement::normalize_image(const cv::Mat &im, double reqMean,
-                                       double reqVar) {
+void FPEnhancement::normalize_image(const cv::Mat &im, double reqMean, double reqVar,
+                                    const cv::Mat &mask, cv::Mat &normalizedImage) {
+    double sum = 0;
+    double sumSquares = 0;
+    double count = 0;
+    accumulate_statistics(im, mask, sum, sumSquares, count);
 
-    cv::Mat convertedIm;
-    im.convertTo(convertedIm, CV_32FC1);
+    double mean, stdDev;
+    mean_deviation(sum, sumSquares, count, mean, stdDev);
 
-    cv::Scalar mean = cv::mean(convertedIm);
-    cv::Mat normalizedImage = convertedIm - mean[0];
+    double scale = stdDev > 0 ? std::sqrt(reqVar) / stdDev : 0;
 
-    cv::Scalar normMean = cv::mean(normalizedImage);
-    float stdNorm = deviation(normalizedImage, normMean[0]);
-    normalizedImage = normalizedImage / stdNorm;
-    normalizedImage = reqMean + normalizedImage * cv::sqrt(reqVar);
+    im.convertTo(normalizedImage, CV_32FC1, scale, reqMean - mean * scale);
+}
+
+/*
+ * Normalization of the blurred image to zero mean and unit variance, over
+ * the whole image or over a window around each pixel if normalizationWindow
+ * is set.
+ */
+cv::Mat FPEnhancement::normalize_blurred(const cv::Mat &blurredImage, const cv::Mat &mask,
+                                         Workspace &workspace) const {
+    if (normalizationWindow > 0) {
+        return local_normalize(blurredImage, mask, workspace);
+    }
 
+    cv::Mat normalizedImage = Workspace::view(workspace.normalized, blurredImage.rows,
+                                              blurredImage.cols, CV_32FC1);
+    normalize_image(blurredImage, 0, 1, mask, normalizedImage);
     return normalizedImage;
 }
 
 /*
- * Calculate gradient in x- and y-direction of the image
+ * Local normalization: each pixel is normalized with the mean and the
+ * standard deviation of the normalizationWindow x normalizationWindow
+ * window centered on it, clipped to the image. The window statistics are
+ * read in constant time from the integral images of the pixels and of
+ * their squares.
+ *
+ * Only the non-zero pixels of `mask` are accounted for, unless it is
+ * empty. The variance is floored at minLocalVariance so that flat regions
+ * are not amplified into noise.
+ *
+ * For 8 bits images, the integral images are kept in 32 bits integers and
+ * built in parallel with the mask applied on the fly, see integral_wrapped,
+ * and the window statistics are computed in float. Other depths and larger
+ * windows use double integral images.
  */
-void FPEnhancement::gradient(const cv::Mat &image, cv::Mat &xGradient,
-                             cv::Mat &yGradient) const {
-    xGradient = cv::Mat::zeros(image.rows, image.cols, ddepth);
-    yGradient = cv::Mat::zeros(image.rows, image.cols, ddepth);
+cv::Mat FPEnhancement::local_normalize(const cv::Mat &im, const cv::Mat &mask,
+                                       Workspace &workspace) const {
+    int rows = im.rows;
+    int cols = im.cols;
+    int radius = normalizationWindow / 2;
+
+    cv::Mat normalizedImage = Workspace::view(workspace.normalized, rows, cols, CV_32FC1);
+
+    if (im.depth() == CV_8U && radius <= maxIntegerNormalizationRadius) {
+        cv::Mat sums = Workspace::view(workspace.sums, rows + 1, cols + 1, CV_32SC1);
+        cv::Mat squares = Workspace::view(workspace.squares, rows + 1, cols + 1, CV_32SC1);
+        cv::Mat counts;
+        if (!mask.empty()) {
+            counts = Workspace::view(workspace.counts, rows + 1, cols + 1, CV_32SC1);
+        }
+        integral_wrapped(im, mask, sums, squares, counts);
+
+        run_parallel(cv::Range(0, rows), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                int y0 = std::max(i - radius, 0);
+                int y1 = std::min(i + radius + 1, rows);
+                const auto *sums_0 = sums.ptr<uint32_t>(y0);
+                const auto *sums_1 = sums.ptr<uint32_t>(y1);
+                const auto *squares_0 = squares.ptr<uint32_t>(y0);
+                const auto *squares_1 = squares.ptr<uint32_t>(y1);
+                const auto *counts_0 = counts.empty() ? nullptr : counts.ptr<int>(y0);
+                const auto *counts_1 = counts.empty() ? nullptr : counts.ptr<int>(y1);
+                const auto *im_i = im.ptr<uchar>(i);
+                auto *normalizedImage_i = normalizedImage.ptr<float>(i);
+
+                for (int j = 0; j < cols; j++) {
+                    int x0 = std::max(j - radius, 0);
+                    int x1 = std::min(j + radius + 1, cols);
+
+                    int64_t count = counts_0 ? counts_1[x1] - counts_1[x0] - counts_0[x1] + counts_0[x0]
+                                             : (int64_t) (y1 - y0) * (x1 - x0);
+                    if (count < 2) {
+                        normalizedImage_i[j] = 0;
+                        continue;
+                    }
+
+                    // Exact modulo 2^32, hence exact as the window sums fit
+                    int64_t sum = (uint32_t) (sums_1[x1] - sums_1[x0] - sums_0[x1] + sums_0[x0]);
+                    int64_t sumSquares = (uint32_t) (squares_1[x1] - squares_1[x0] - squares_0[x1] + squares_0[x0]);
+
+                    // Variance times count * (count - 1), exact in 64 bits
+                    float scatter = (float) (count * sumSquares - sum * sum);
+                    float variance = scatter / (float) (count * (count - 1));
+                    float mean = (float) sum / (float) count;
+
+                    normalizedImage_i[j] = (im_i[j] - mean) /
+                                           std::sqrt(std::max(variance, (float) minLocalVariance));
+                }
+            }
+        });
 
-    // Pointer access more effective than Mat.at<T>()
-    for (int i = 1; i < image.rows - 1; i++) {
-        const auto *image_i = image.ptr<float>(i);
-        auto *xGradient_i = xGradient.ptr<float>(i);
-        auto *yGradient_i = yGradient.ptr<float>(i);
-        for (int j = 1; j < image.cols - 1; j++) {
-            float xPixel1 = image_i[j - 1];
-            float xPixel2 = image_i[j + 1];
+        return normalizedImage;
+    }
 
-            float yPixel1 = image.at<float>(i - 1, j);
-            float yPixel2 = image.at<float>(i + 1, j);
+    cv::Mat pixels = im;
+    if (im.depth() != CV_8U) {
+        im.convertTo(pixels, CV_32FC1);
+    }
 
-            float xGrad;
-            float yGrad;
+    cv::Mat masked = pixels;
+    cv::Mat counts;
+    if (!mask.empty()) {
+        masked = Workspace::view(workspace.masked, rows, cols, pixels.type());
+        masked.setTo(0);
+        pixels.copyTo(masked, mask);
+
+        cv::Mat maskUnits = Workspace::view(workspace.maskUnits, rows, cols, CV_8UC1);
+        cv::min(mask, 1, maskUnits);
+        counts = Workspace::view(workspace.counts, rows + 1, cols + 1, CV_32SC1);
+        cv::integral(maskUnits, counts, CV_32S);
+    }
 
-            if (j == 0) {
-                xPixel1 = image_i[j];
-                xGrad = xPixel2 - xPixel1;
-            } else if (j == image.cols - 1) {
-                xPixel2 = image_i[j];
-                xGrad = xPixel2 - xPixel1;
-            } else {
-                xGrad = 0.5f * (xPixel2 - xPixel1);
+    cv::Mat sums = Workspace::view(workspace.sums, rows + 1, cols + 1, CV_64FC1);
+    cv::Mat squares = Workspace::view(workspace.squares, rows + 1, cols + 1, CV_64FC1);
+    cv::integral(masked, sums, squares, CV_64F, CV_64F);
+
+    run_parallel(cv::Range(0, rows), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++) {
+            int y0 = std::max(i - radius, 0);
+            int y1 = std::min(i + radius + 1, rows);
+            const auto *sums_0 = sums.ptr<double>(y0);
+            const auto *sums_1 = sums.ptr<double>(y1);
+            const auto *squares_0 = squares.ptr<double>(y0);
+            const auto *squares_1 = squares.ptr<double>(y1);
+            const auto *counts_0 = counts.empty() ? nullptr : counts.ptr<int>(y0);
+            const auto *counts_1 = counts.empty() ? nullptr : counts.ptr<int>(y1);
+            const auto *pixels8_i = pixels.depth() == CV_8U ? pixels.ptr<uchar>(i) : nullptr;
+            const auto *pixels32_i = pixels.depth() == CV_8U ? nullptr : pixels.ptr<float>(i);
+            auto *normalizedImage_i = normalizedImage.ptr<float>(i);
+
+            for (int j = 0; j < cols; j++) {
+                int x0 = std::max(j - radius, 0);
+                int x1 = std::min(j + radius + 1, cols);
+
+                double count = counts_0 ? counts_1[x1] - counts_1[x0] - counts_0[x1] + counts_0[x0]
+                                        : (double) (y1 - y0) * (x1 - x0);
+                if (count < 2) {
+                    normalizedImage_i[j] = 0;
+                    continue;
+                }
+
+                double sum = sums_1[x1] - sums_1[x0] - sums_0[x1] + sums_0[x0];
+                double sumSquares = squares_1[x1] - squares_1[x0] - squares_0[x1] + squares_0[x0];
+                double mean = sum / count;
+                double variance = (sumSquares - sum * mean) / (count - 1);
+
+                double pixel = pixels8_i ? pixels8_i[j] : pixels32_i[j];
+                normalizedImage_i[j] = (float) ((pixel - mean) / std::sqrt(std::max(variance, minLocalVariance)));
             }
+        }
+    });
 
-            if (i == 0) {
-                yPixel1 = image_i[j];
-                yGrad = yPixel2 - yPixel1;
-            } else if (i == image.rows - 1) {
-                yPixel2 = image_i[j];
-                yGrad = yPixel2 - yPixel1;
-            } else {
-                yGrad = 0.5f * (yPixel2 - yPixel1);
+    return normalizedImage;
+}
+
+/*
+ * Integral images of the 8 bits image `im`, of its squares and, unless
+ * `mask` is empty, of its non-zero pixels in `counts`. Pixels outside the
+ * mask are summed as zeros. The integrals are 32 bits unsigned integers
+ * which wrap around: the difference of four entries is exact modulo 2^32,
+ * so any window sum below 2^32 is exact.
+ *
+ * Bands of integralBandHeight rows are integrated from zero in parallel,
+ * then the last row of each band, once complete, is added to the next band.
+ */
+void FPEnhancement::integral_wrapped(const cv::Mat &im, const cv::Mat &mask,
+                                     cv::Mat &sums, cv::Mat &squares, cv::Mat &counts) const {
+    int rows = im.rows;
+    int cols = im.cols;
+    int bandCount = (rows + integralBandHeight - 1) / integralBandHeight;
+
+    cv::Mat *integrals[] = {&sums, &squares, &counts};
+    int integralCount = mask.empty() ? 2 : 3;
+
+    for (int n = 0; n < integralCount; n++) {
+        std::fill(integrals[n]->ptr<uint32_t>(0), integrals[n]->ptr<uint32_t>(0) + cols + 1, 0);
+    }
+
+    run_parallel(cv::Range(0, bandCount), [&](const cv::Range &range) {
+        for (int b = range.start; b < range.end; b++) {
+            int y0 = b * integralBandHeight;
+            int y1 = std::min(y0 + integralBandHeight, rows);
+
+            for (int i = y0; i < y1; i++) {
+                // The first row of a band adds up to the zero row
+                int above = i > y0 ? i : 0;
+                const auto *im_i = im.ptr<uchar>(i);
+                const auto *mask_i = mask.empty() ? nullptr : mask.ptr<uchar>(i);
+                const auto *sums_i = sums.ptr<uint32_t>(above);
+                const auto *squares_i = squares.ptr<uint32_t>(above);
+                auto *sums_n = sums.ptr<uint32_t>(i + 1);
+                auto *squares_n = squares.ptr<uint32_t>(i + 1);
+
+                uint32_t rowSum = 0;
+                uint32_t rowSquares = 0;
+                sums_n[0] = 0;
+                squares_n[0] = 0;
+                for (int j = 0; j < cols; j++) {
+                    uint32_t pixel = mask_i && !mask_i[j] ? 0 : im_i[j];
+                    rowSum += pixel;
+                    rowSquares += pixel * pixel;
+                    sums_n[j + 1] = sums_i[j + 1] + rowSum;
+                    squares_n[j + 1] = squares_i[j + 1] + rowSquares;
+                }
+
+                if (mask_i) {
+                    const auto *counts_i = counts.ptr<uint32_t>(above);
+                    auto *counts_n = counts.ptr<uint32_t>(i + 1);
+
+                    uint32_t rowCount = 0;
+                    counts_n[0] = 0;
+                    for (int j = 0; j < cols; j++) {
+                        rowCount += mask_i[j] != 0;
+                        counts_n[j + 1] = counts_i[j + 1] + rowCount;
+                    }
+                }
             }
+        }
+    });
+
+    // Row of the integrals holding the sums of the first `band` bands
+    auto band_end = [&](int band) { return std::min(band * integralBandHeight, rows); };
 
-            xGradient_i[j] = xGrad;
-            yGradient_i[j] = yGrad;
+    auto add_row = [&](int target, int source) {
+        for (int n = 0; n < integralCount; n++) {
+            auto *target_row = integrals[n]->ptr<uint32_t>(target);
+            const auto *source_row = integrals[n]->ptr<uint32_t>(source);
+            for (int j = 1; j <= cols; j++) {
+                target_row[j] += source_row[j];
+            }
         }
+    };
+
+    // Last rows first, one band after the other, then the other rows
+    for (int b = 1; b < bandCount; b++) {
+        add_row(band_end(b + 1), band_end(b));
     }
+
+    run_parallel(cv::Range(1, bandCount), [&](const cv::Range &range) {
+        for (int b = range.start; b < range.end; b++) {
+            for (int i = band_end(b) + 1; i < band_end(b + 1); i++) {
+                add_row(i, band_end(b));
+            }
+        }
+    });
 }
 
 /*
- * Estimate orientation field of fingerprint ridges.
+ * Add the sum, the sum of squares and the number of the pixels of a single
+ * channel image, or of the non-zero pixels of `mask` if it is not empty.
+ *
+ * 8 bits images are summed exactly with integers, one row at a time, and
+ * other depths in double precision.
  */
-cv::Mat FPEnhancement::orient_ridge(const cv::Mat &im) {
+void FPEnhancement::accumulate_statistics(const cv::Mat &im, const cv::Mat &mask,
+                                          double &sum, double &sumSquares, double &count) {
+    cv::Mat row;
 
-    cv::Mat gradX, gradY;
-    cv::Mat sin2theta;
-    cv::Mat cos2theta;
-
-    int kernelSize = 6 * round(gradientSigma);
+    for (int i = 0; i < im.rows; i++) {
+        const auto *mask_i = mask.empty() ? nullptr : mask.ptr<uchar>(i);
+
+        if (im.depth() == CV_8U) {
+            const auto *im_i = im.ptr<uchar>(i);
+            uint64_t rowSum = 0;
+            uint64_t rowSquares = 0;
+            uint64_t rowCount = 0;
+
+            if (mask_i) {
+                for (int j = 0; j < im.cols; j++) {
+                    uint32_t pixel = mask_i[j] ? im_i[j] : 0;
+                    rowSum += pixel;
+                    rowSquares += pixel * pixel;
+                    rowCount += mask_i[j] != 0;
+                }
+            } else {
+                for (int j = 0; j < im.cols; j++) {
+                    uint32_t pixel = im_i[j];
+                    rowSum += pixel;
+                    rowSquares += pixel * pixel;
+                }
+                rowCount = im.cols;
+            }
 
-    if (kernelSize % 2 == 0) {
-        kernelSize++;
-    }
+            sum += rowSum;
+            sumSquares += rowSquares;
+            count += rowCount;
+            continue;
+        }
 
-    // Define Gaussian kernel
-    cv::Mat gaussKernelX =
-            cv::getGaussianKernel(kernelSize, gradientSigma, CV_32FC1);
-    cv::Mat gaussKernelY =
-            cv::getGaussianKernel(kernelSize, gradientSigma, CV_32FC1);
-    cv::Mat gaussKernel = gaussKernelX * gaussKernelY.t();
+        im.row(i).convertTo(row, CV_64FC1);
+        const auto *row_i = row.ptr<double>(0);
+        double rowSum = 0;
+        double rowSquares = 0;
 
-    // Peform Gaussian filtering
-    cv::Mat fx, fy;
-    cv::Mat kernelx = (cv::Mat_<float>(1, 3) << -0.5, 0, 0.5);
-    cv::Mat kernely = (cv::Mat_<float>(3, 1) << -0.5, 0, 0.5);
-    cv::filter2D(gaussKernel, fx, -1, kernelx);
-    cv::filter2D(gaussKernel, fy, -1, kernely);
+        for (int j = 0; j < im.cols; j++) {
+            if (mask_i && !mask_i[j]) {
+                continue;
+            }
+            rowSum += row_i[j];
+            rowSquares += row_i[j] * row_i[j];
+            count++;
+        }
 
-    // Gradient of Gaussian
-    gradient(gaussKernel, fx, fy);
+        sum += rowSum;
+        sumSquares += rowSquares;
+    }
+}
 
-    gradX.convertTo(gradX, CV_32FC1);
-    gradY.convertTo(gradY, CV_32FC1);
+/*
+ * Mean and sample standard deviation from the accumulated statistics.
+ */
+void FPEnhancement::mean_deviation(double sum, double sumSquares, double count,
+                                   double &mean, double &stdDev) {
+    mean = count > 0 ? sum / count : 0;
+    double variance = count > 1 ? (sumSquares - sum * mean) / (count - 1) : 0;
+    stdDev = std::sqrt(std::max(variance, 0.0));
+}
 
-    // Gradient of the image in x
-    cv::filter2D(im, gradX, -1, fx, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
-    // Gradient of the image in y
-    cv::filter2D(im, gradY, -1, fy, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+/*
+ * Separable kernels of the gradient of a Gaussian of the given size.
+ *
+ * The 2D x-derivative kernel is the central difference of the Gaussian
+ * along x, with its outer rows and columns set to zero, which is exactly
+ * derivativeKernel along x times smoothKernel along y. The y-derivative
+ * kernel is its transpose.
+ */
+void FPEnhancement::gradient_kernels(int kernelSize, double sigma,
+                                     cv::Mat &smoothKernel, cv::Mat &derivativeKernel) {
+    cv::Mat gaussKernel = cv::getGaussianKernel(kernelSize, sigma, CV_32FC1);
 
-    cv::Mat grad_xx, grad_xy, grad_yy;
-    cv::multiply(gradX, gradX, grad_xx);
-    cv::multiply(gradX, gradY, grad_xy);
-    cv::multiply(gradY, gradY, grad_yy);
+    smoothKernel = cv::Mat::zeros(kernelSize, 1, CV_32FC1);
+    derivativeKernel = cv::Mat::zeros(kernelSize, 1, CV_32FC1);
 
-    // Now smooth the covariance data to perform a weighted summation of the data
-    int sze2 = 6 * round(blockSigma);
+    for (int i = 1; i < kernelSize - 1; i++) {
+        smoothKernel.at<float>(i) = gaussKernel.at<float>(i);
+        derivativeKernel.at<float>(i) =
+                0.5f * (gaussKernel.at<float>(i + 1) - gaussKernel.at<float>(i - 1));
+    }
+}
 
-    if (sze2 % 2 == 0) {
-        sze2++;
+/*
+ * Gaussian smoothing of a float image.
+ *
+ * The kernel is applied separably. For large sigmas and if
+ * recursiveSmoothing is set, a recursive Gaussian is used instead, whose
+ * cost does not depend on sigma.
+ */
+void FPEnhancement::gaussian_smooth(const cv::Mat &src, cv::Mat &dst,
+                                    int kernelSize, double sigma) const {
+    if (recursiveSmoothing && sigma >= recursiveMinSigma) {
+        recursive_gaussian(src, dst, sigma);
+        return;
     }
 
-    cv::Mat gaussKernelX2 = cv::getGaussianKernel(sze2, blockSigma, CV_32FC1);
-    cv::Mat gaussKernelY2 = cv::getGaussianKernel(sze2, blockSigma, CV_32FC1);
-    cv::Mat gaussKernel2 = gaussKernelX2 * gaussKernelY2.t();
+    cv::Mat gaussKernel = cv::getGaussianKernel(kernelSize, sigma, CV_32FC1);
+    cv::sepFilter2D(src, dst, -1, gaussKernel, gaussKernel, cv::Point(-1, -1), 0,
+                    cv::BORDER_DEFAULT);
+}
 
-    cv::filter2D(grad_xx, grad_xx, -1, gaussKernel2, cv::Point(-1, -1), 0,
-                 cv::BORDER_DEFAULT);
-    cv::filter2D(grad_xy, grad_xy, -1, gaussKernel2, cv::Point(-1, -1), 0,
-                 cv::BORDER_DEFAULT);
-    cv::filter2D(grad_yy, grad_yy, -1, gaussKernel2, cv::Point(-1, -1), 0,
-                 cv::BORDER_DEFAULT);
+/*
+ * Feedback coefficients b1 / b0, b2 / b0 and b3 / b0 of the recursive
+ * Gaussian filter.
+ *
+ * The closed form for q given in the paper overestimates sigma by about
+ * 10%, so q is instead solved by bisection for the impulse response of the
+ * causal and anti-causal filters to have a variance of exactly sigma^2.
+ */
+void FPEnhancement::recursive_gaussian_coefficients(double sigma, double *coefficients) {
+    double low = 0.1;
+    double high = 2 * sigma + 2;
+
+    for (int iteration = 0; iteration < 60; iteration++) {
+        double q = (low + high) / 2;
+        double q2 = q * q;
+        double q3 = q2 * q;
+
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        coefficients[0] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+        coefficients[1] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+        coefficients[2] = 0.422205 * q3 / b0;
+
+        // Moments of the causal filter B / (1 - sum_k b_k z^-k), from the
+        // derivatives of its transfer function at z = 1
+        double B = 1 - (coefficients[0] + coefficients[1] + coefficients[2]);
+        double mean = (coefficients[0] + 2 * coefficients[1] + 3 * coefficients[2]) / B;
+        double variance = (2 * coefficients[1] + 6 * coefficients[2]) / B + mean * mean + mean;
+
+        if (2 * variance < sigma * sigma) {
+            low = q;
+        } else {
+            high = q;
+        }
+    }
+}
 
-    grad_xy *= 2;
+/*
+ * Recursive Gaussian filter of Young and van Vliet,
+ * 'Recursive implementation of the Gaussian filter', Signal Processing,
+ * vol. 44, 1995.
+ *
+ * Each direction is filtered by a causal then an anti-causal third order
+ * IIR filter, i.e. 12 multiply-adds per pixel whatever the sigma. Borders
+ * are handled by replicating the edge pixels.
+ *
+ * Each row is read whole before it is written, and the vertical pass runs
+ * in place, so `dst` may be `src`. The callers smooth their workspace
+ * buffers in place, and only a row of scratch is allocated per stripe.
+ */
+void FPEnhancement::recursive_gaussian(const cv::Mat &src, cv::Mat &dst,
+                                       double sigma) const {
+    double coefficients[3];
+    recursive_gaussian_coefficients(sigma, coefficients);
+
+    const float b1 = coefficients[0];
+    const float b2 = coefficients[1];
+    const float b3 = coefficients[2];
+    const float B = 1 - (b1 + b2 + b3);
+
+    int rows = src.rows;
+    int cols = src.cols;
+
+    dst.create(rows, cols, CV_32FC1);
+    cv::Mat &result = dst;
+
+    // Horizontal pass, row by row
+    run_parallel(cv::Range(0, rows), [&](const cv::Range &range) {
+        cv::vector<float> w(cols);
+        for (int i = range.start; i < range.end; i++) {
+            const auto *src_i = src.ptr<float>(i);
+            auto *result_i = result.ptr<float>(i);
+
+            float w1 = src_i[0], w2 = src_i[0], w3 = src_i[0];
+            for (int j = 0; j < cols; j++) {
+                w[j] = B * src_i[j] + b1 * w1 + b2 * w2 + b3 * w3;
+                w3 = w2;
+                w2 = w1;
+                w1 = w[j];
+            }
 
-    // Analytic solution of principal direction
-    cv::Mat G1, G2, G3;
-    cv::multiply(grad_xy, grad_xy, G1);
-    G2 = grad_xx - grad_yy;
-    cv::multiply(G2, G2, G2);
+            float y1 = w[cols - 1], y2 = w[cols - 1], y3 = w[cols - 1];
+            for (int j = cols - 1; j >= 0; j--) {
+                result_i[j] = B * w[j] + b1 * y1 + b2 * y2 + b3 * y3;
+                y3 = y2;
+                y2 = y1;
+                y1 = result_i[j];
+            }
+        }
+    });
+
+    // Vertical pass, on whole rows at a time so that the recursion is
+    // vectorized across the columns. Columns are split in strips.
+    const int stripWidth = 256;
+    int stripCount = (cols + stripWidth - 1) / stripWidth;
+
+    run_parallel(cv::Range(0, stripCount), [&](const cv::Range &range) {
+        for (int strip = range.start; strip < range.end; strip++) {
+            int j0 = strip * stripWidth;
+            int j1 = std::min(j0 + stripWidth, cols);
+
+            // Causal pass, in place
+            for (int i = 0; i < rows; i++) {
+                auto *w0 = result.ptr<float>(i);
+                const auto *w1 = result.ptr<float>(std::max(i - 1, 0));
+                const auto *w2 = result.ptr<float>(std::max(i - 2, 0));
+                const auto *w3 = result.ptr<float>(std::max(i - 3, 0));
+                if (i == 0) {
+                    // Steady state of a constant signal
+                    continue;
+                }
+                for (int j = j0; j < j1; j++) {
+                    float w2_j = i >= 2 ? w2[j] : w1[j];
+                    float w3_j = i >= 3 ? w3[j] : (i >= 2 ? w2[j] : w1[j]);
+                    w0[j] = B * w0[j] + b1 * w1[j] + b2 * w2_j + b3 * w3_j;
+                }
+            }
 
-    cv::Mat denom;
-    G3 = G1 + G2;
-    cv::sqrt(G3, denom);
+            // Anti-causal pass, in place
+            for (int i = rows - 2; i >= 0; i--) {
+                auto *y0 = result.ptr<float>(i);
+                const auto *y1 = result.ptr<float>(i + 1);
+                const auto *y2 = result.ptr<float>(std::min(i + 2, rows - 1));
+                const auto *y3 = result.ptr<float>(std::min(i + 3, rows - 1));
+                for (int j = j0; j < j1; j++) {
+                    y0[j] = B * y0[j] + b1 * y1[j] + b2 * y2[j] + b3 * y3[j];
+                }
+            }
+        }
+    });
+}
 
-    cv::divide(grad_xy, denom, sin2theta);
-    cv::divide(grad_xx - grad_yy, denom, cos2theta);
+/*
+ * Estimate orientation field of fingerprint ridges.
+ *
+ * If `coherence` is given, it receives the coherence of the smoothed
+ * structure tensor, between 0 (isotropic) and 1 (perfectly oriented).
+ *
+ * The orientation is returned in radians, or as the CV_8UC1 index of the
+ * closest Gabor filter orientation when `indexed` is set, which saves the
+ * float image and its conversion in filter_ridge.
+ *
+ * With an orientationScale above 1, the structure tensor is estimated on a
+ * downsampled level of the image pyramid with proportionally smaller
+ * sigmas, and the smoothed doubled angles, which are continuous unlike the
+ * orientation, are upsampled bilinearly to the resolution of the image.
+ */
+cv::Mat FPEnhancement::orient_ridge(const cv::Mat &im, Workspace &workspace,
+                                    cv::Mat *coherence, bool indexed) const {
+    int rows = im.rows;
+    int cols = im.cols;
+    int orientCount = 180 / angleInc;
+
+    cv::Mat orientim = Workspace::view(workspace.orientation, rows, cols, indexed ? CV_8UC1 : CV_32FC1);
+
+    auto orientation_row = [&](int i, int j, int n, const float *sin2theta_i, const float *cos2theta_i) {
+        if (indexed) {
+            gabor::orientationIndices(sin2theta_i, cos2theta_i, orientim.ptr<uchar>(i) + j, n, orientCount);
+        } else {
+            gabor::orientationAngles(sin2theta_i, cos2theta_i, orientim.ptr<float>(i) + j, n);
+        }
+    };
 
-    int sze3 = 6 * round(orientSmoothSigma);
+    if (orientationScale == 1) {
+        doubled_angles(im, 1, workspace, coherence, orientation_row);
+    } else {
+        cv::Mat coarse = im;
+        for (int scale = 1; scale < orientationScale; scale *= 2) {
+            cv::pyrDown(coarse, coarse);
+        }
 
-    if (sze3 % 2 == 0) {
-        sze3 += 1;
+        cv::Mat coarseSin2theta = Workspace::view(workspace.coarseSin2theta, coarse.rows, coarse.cols, CV_32FC1);
+        cv::Mat coarseCos2theta = Workspace::view(workspace.coarseCos2theta, coarse.rows, coarse.cols, CV_32FC1);
+
+        doubled_angles(coarse, orientationScale, workspace, coherence,
+                       [&](int i, int j, int n, const float *sin2theta_i, const float *cos2theta_i) {
+                           std::copy(sin2theta_i, sin2theta_i + n, coarseSin2theta.ptr<float>(i) + j);
+                           std::copy(cos2theta_i, cos2theta_i + n, coarseCos2theta.ptr<float>(i) + j);
+                       });
+
+        // The full resolution doubled angles reuse the buffers of the bands
+        Workspace::Lease buffers = workspace.band();
+        cv::Mat sin2theta = Workspace::view(buffers->sin2theta, rows, cols, CV_32FC1);
+        cv::Mat cos2theta = Workspace::view(buffers->cos2theta, rows, cols, CV_32FC1);
+        cv::resize(coarseSin2theta, sin2theta, im.size(), 0, 0, cv::INTER_LINEAR);
+        cv::resize(coarseCos2theta, cos2theta, im.size(), 0, 0, cv::INTER_LINEAR);
+        if (coherence) {
+            cv::resize(*coherence, *coherence, im.size(), 0, 0, cv::INTER_LINEAR);
+        }
+
+        run_parallel(cv::Range(0, rows), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                orientation_row(i, 0, cols, sin2theta.ptr<float>(i), cos2theta.ptr<float>(i));
+            }
+        });
     }
 
-    cv::Mat gaussKernelX3 =
-            cv::getGaussianKernel(sze3, orientSmoothSigma, CV_32FC1);
-    cv::Mat gaussKernelY3 =
-            cv::getGaussianKernel(sze3, orientSmoothSigma, CV_32FC1);
-    cv::Mat gaussKernel3 = gaussKernelX3 * gaussKernelY3.t();
+    if (!indexed && ddepth != CV_32FC1) {
+        orientim.convertTo(orientim, ddepth);
+    }
 
-    cv::filter2D(cos2theta, cos2theta, -1, gaussKernel3, cv::Point(-1, -1), 0,
-                 cv::BORDER_DEFAULT);
-    cv::filter2D(sin2theta, sin2theta, -1, gaussKernel3, cv::Point(-1, -1), 0,
-                 cv::BORDER_DEFAULT);
+    return orientim;
+}
 
-    sin2theta.convertTo(sin2theta, ddepth);
-    cos2theta.convertTo(cos2theta, ddepth);
-    cv::Mat orientim = cv::Mat::zeros(sin2theta.rows, sin2theta.cols, ddepth);
+/*
+ * Odd size of the Gaussian kernels of orient_ridge for a given sigma,
+ * covering 3 sigmas on each side.
+ */
+int FPEnhancement::smoothing_size(double sigma) {
+    int size = 6 * round(sigma);
 
-    // Pointer access more effective than Mat.at<T>()
-    for (int i = 0; i < sin2theta.rows; i++) {
-        const float *sin2theta_i = sin2theta.ptr<float>(i);
-        const float *cos2theta_i = cos2theta.ptr<float>(i);
-        auto *orientim_i = orientim.ptr<float>(i);
-        for (int j = 0; j < sin2theta.cols; j++) {
-            orientim_i[j] = (M_PI + std::atan2(sin2theta_i[j], cos2theta_i[j])) / 2;
-        }
+    if (size % 2 == 0) {
+        size++;
     }
 
-    return orientim;
+    // A derivative needs at least 3 taps
+    return std::max(size, 3);
 }
 
 /*
- * Compute the standard deviation of the image.
+ * Radius of gaussian_smooth of deviation `sigma`, truncated at
+ * recursiveHaloSigmas for the recursive Gaussian.
  */
-float FPEnhancement::deviation(const cv::Mat &im, float average) {
-    float sdev = 0.0;
+int FPEnhancement::smoothing_radius(double sigma) const {
+    if (recursiveSmoothing && sigma >= recursiveMinSigma) {
+        return (int) std::ceil(recursiveHaloSigmas * sigma);
+    }
+    return smoothing_size(sigma) / 2;
+}
 
-    for (int i = 0; i < im.rows; i++) {
-        for (int j = 0; j < im.cols; j++) {
-            float pixel = im.at<float>(i, j);
-            float dev = (pixel - average) * (pixel - average);
-            sdev = sdev + dev;
-        }
+/*
+ * Smoothed doubled angles (sin 2theta, cos 2theta) of the ridges of `im`,
+ * seen at 1 / `scale` of the resolution of the sigmas.
+ *
+ * All the steps (gradient, structure tensor, its smoothing, the doubled
+ * angles and their smoothing) are fused on tiles, and the smoothed angles
+ * of each row of a tile are handed to `emit` as soon as they are ready.
+ * Each tile is extended by the radii of the smoothings so that its result
+ * is the same as processing the whole image at once, and sized so that its
+ * three working buffers fit in orientTileBudget. The gradients are
+ * overwritten by the tensor, whose smoothed components are overwritten by
+ * the angles.
+ *
+ * The recursive Gaussian has an infinite support. It is truncated at
+ * recursiveHaloSigmas, so the result is then approximate at tile seams.
+ */
+void FPEnhancement::doubled_angles(const cv::Mat &im, int scale, Workspace &workspace, cv::Mat *coherence,
+                                   const std::function<void(int, int, int, const float *, const float *)> &emit) const {
+    int rows = im.rows;
+    int cols = im.cols;
+
+    // The pyramid already smooths the image, so the gradient keeps a
+    // minimal support at coarse levels
+    double gradSigma = std::max(gradientSigma / scale, 0.5);
+    double tensorSigma = blockSigma / scale;
+    double angleSigma = orientSmoothSigma / scale;
+
+    // Gradient of Gaussian, as separable kernels
+    cv::Mat smoothKernel, derivativeKernel;
+    gradient_kernels(smoothing_size(gradSigma), gradSigma, smoothKernel, derivativeKernel);
+
+    // Smoothing of the covariance data to perform a weighted summation of the data
+    int sze2 = smoothing_size(tensorSigma);
+
+    // Smoothing of the doubled angles
+    int sze3 = smoothing_size(angleSigma);
+
+    int blockRadius = smoothing_radius(tensorSigma);
+    int orientRadius = smoothing_radius(angleSigma);
+
+    if (coherence) {
+        coherence->create(rows, cols, CV_32FC1);
     }
 
-    int size = im.rows * im.cols;
-    float var = sdev / (size - 1);
-    float sd = std::sqrt(var);
+    // Largest square extended tile within the budget, then the tallest tile
+    // of that width
+    int halo = blockRadius + orientRadius;
+    size_t tilePixels = orientTileBudget / (3 * sizeof(float));
+    int side = (int) std::sqrt((double) tilePixels);
+    int tileWidth = std::min(cols, std::max(side - 2 * halo, minOrientTileSize));
+    int tileHeight = std::min(rows, std::max((int) (tilePixels / (tileWidth + 2 * halo)) - 2 * halo,
+                                             minOrientTileSize));
+    int tileRows = (rows + tileHeight - 1) / tileHeight;
+    int tileCols = (cols + tileWidth - 1) / tileWidth;
+    cv::Rect image(0, 0, cols, rows);
+
+    run_parallel(cv::Range(0, tileRows * tileCols), [&](const cv::Range &range) {
+        Workspace::Lease buffers = workspace.band();
+
+        for (int tile = range.start; tile < range.end; tile++) {
+            // Pixels of the output, of the doubled angles and of the tensor
+            cv::Rect out = cv::Rect((tile % tileCols) * tileWidth, (tile / tileCols) * tileHeight,
+                                    tileWidth, tileHeight) & image;
+            cv::Rect angles = cv::Rect(out.x - orientRadius, out.y - orientRadius,
+                                       out.width + 2 * orientRadius, out.height + 2 * orientRadius) & image;
+            cv::Rect tensor = cv::Rect(angles.x - blockRadius, angles.y - blockRadius,
+                                       angles.width + 2 * blockRadius, angles.height + 2 * blockRadius) & image;
+
+            // Gradient of the image. Filtering a region reads the
+            // neighbouring pixels of the image, as for the whole image.
+            cv::Mat grad_xx = Workspace::view(buffers->gradX, tensor.height, tensor.width, CV_32FC1);
+            cv::Mat grad_yy = Workspace::view(buffers->gradY, tensor.height, tensor.width, CV_32FC1);
+            cv::Mat grad_xy = Workspace::view(buffers->grad_xy, tensor.height, tensor.width, CV_32FC1);
+            cv::sepFilter2D(im(tensor), grad_xx, CV_32F, derivativeKernel, smoothKernel,
+                            cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+            cv::sepFilter2D(im(tensor), grad_yy, CV_32F, smoothKernel, derivativeKernel,
+                            cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+
+            cv::multiply(grad_xx, grad_yy, grad_xy);
+            cv::multiply(grad_xx, grad_xx, grad_xx);
+            cv::multiply(grad_yy, grad_yy, grad_yy);
+
+            // Pixels further than blockRadius from the tile edges are exact
+            gaussian_smooth(grad_xx, grad_xx, sze2, tensorSigma);
+            gaussian_smooth(grad_xy, grad_xy, sze2, tensorSigma);
+            gaussian_smooth(grad_yy, grad_yy, sze2, tensorSigma);
+
+            // Analytic solution of principal direction, as the doubled
+            // angles, written over grad_xy and grad_xx
+            for (int i = angles.y; i < angles.y + angles.height; i++) {
+                auto *grad_xx_i = grad_xx.ptr<float>(i - tensor.y) - tensor.x;
+                auto *grad_xy_i = grad_xy.ptr<float>(i - tensor.y) - tensor.x;
+                const auto *grad_yy_i = grad_yy.ptr<float>(i - tensor.y) - tensor.x;
+                auto *coherence_i = coherence && i >= out.y && i < out.y + out.height
+                                    ? coherence->ptr<float>(i) : nullptr;
+
+                for (int j = angles.x; j < angles.x + angles.width; j++) {
+                    float xy2 = 2 * grad_xy_i[j];
+                    float diff = grad_xx_i[j] - grad_yy_i[j];
+                    float denom = std::sqrt(xy2 * xy2 + diff * diff);
+
+                    if (coherence_i && j >= out.x && j < out.x + out.width) {
+                        float energy = grad_xx_i[j] + grad_yy_i[j];
+                        coherence_i[j] = energy != 0 ? denom / energy : 0;
+                    }
+
+                    // Same as cv::divide, which gives 0 when dividing by 0
+                    grad_xy_i[j] = denom != 0 ? xy2 / denom : 0;
+                    grad_xx_i[j] = denom != 0 ? diff / denom : 0;
+                }
+            }
 
-    return sd;
+            // Pixels further than orientRadius from the tile edges are exact.
+            // The region shares its edges with the buffer on the image
+            // sides, where the border is then reflected as for the image.
+            cv::Rect anglesInTensor(angles.x - tensor.x, angles.y - tensor.y, angles.width, angles.height);
+            cv::Mat sin2theta = grad_xy(anglesInTensor);
+            cv::Mat cos2theta = grad_xx(anglesInTensor);
+            gaussian_smooth(cos2theta, cos2theta, sze3, angleSigma);
+            gaussian_smooth(sin2theta, sin2theta, sze3, angleSigma);
+
+            for (int i = out.y; i < out.y + out.height; i++) {
+                int offset = out.x - angles.x;
+                emit(i, out.x, out.width, sin2theta.ptr<float>(i - angles.y) + offset,
+                     cos2theta.ptr<float>(i - angles.y) + offset);
+            }
+        }
+    });
 }
 
 /*
@@ -270,6 +1539,17 @@ float FPEnhancement::deviation(const cv::Mat &im, float average) {
  * to the fingerprint.
  */
 cv::Mat FPEnhancement::postProcessingFilter(const cv::Mat &inputImage) const {
+    return foreground_mask(inputImage, 1.0);
+}
+
+/*
+ * Compute the filter of postProcessingFilter on the image downscaled by
+ * `scale`, then upscale it back to the size of the image.
+ *
+ * The blurring and dilation sizes are scaled accordingly, so that the
+ * downscaled mask covers the same region at a fraction of the cost.
+ */
+cv::Mat FPEnhancement::foreground_mask(const cv::Mat &inputImage, double scale) const {
     cv::Mat inputImageGrey;
     cv::Mat filter;
 
@@ -279,9 +1559,20 @@ cv::Mat FPEnhancement::postProcessingFilter(const cv::Mat &inputImage) const {
         inputImageGrey = inputImage.clone();
     }
 
+    int scaledBlurringTimes = blurringTimes;
+    int scaledDilationSize = dilationSize;
+
+    if (scale < 1.0) {
+        cv::resize(inputImageGrey, inputImageGrey, cv::Size(), scale, scale, cv::INTER_AREA);
+
+        // Repeated box blurs add up their variances, which scale as scale^2
+        scaledBlurringTimes = std::max((int) std::round(blurringTimes * scale * scale), 1);
+        scaledDilationSize = std::max((int) std::round(dilationSize * scale), 1);
+    }
+
     // Blurring the image several times with a kernel 3x3
     // to have smooth surfaces
-    for (int j = 0; j < blurringTimes; j++) {
+    for (int j = 0; j < scaledBlurringTimes; j++) {
         blur(inputImageGrey, inputImageGrey, cv::Size(3, 3));
     }
 
@@ -294,8 +1585,8 @@ cv::Mat FPEnhancement::postProcessingFilter(const cv::Mat &inputImage) const {
     inputImageGrey.copyTo(processedImage, filter);
 
     cv::Mat element = cv::getStructuringElement(
-            dilationType, cv::Size(2 * dilationSize + 1, 2 * dilationSize + 1),
-            cv::Point(dilationSize, dilationSize));
+            dilationType, cv::Size(2 * scaledDilationSize + 1, 2 * scaledDilationSize + 1),
+            cv::Point(scaledDilationSize, scaledDilationSize));
 
     // Dilate the image to get the contour of the finger
     dilate(processedImage, processedImage, element);
@@ -304,159 +1595,832 @@ cv::Mat FPEnhancement::postProcessingFilter(const cv::Mat &inputImage) const {
     floodFill(processedImage, cv::Point(filter.cols / 2, filter.rows / 2),
               cv::Scalar(255));
 
+    if (scale < 1.0) {
+        cv::resize(processedImage, processedImage, inputImage.size(), 0, 0, cv::INTER_NEAREST);
+    }
+
     return processedImage;
 }
 
 /*
- * This is equivalent to Matlab's 'meshgrid' function
-*/
-void FPEnhancement::meshgrid(int kernelSize, cv::Mat &meshX, cv::Mat &meshY) {
-    std::vector<int> t;
+ * Estimate the ridge frequency of each block of the image.
+ *
+ * Returns a (rows / freqBlockSize) x (cols / freqBlockSize) CV_32FC1 map
+ * (rounded up). Blocks where no reliable frequency could be found get the
+ * median frequency of the valid blocks, or freqValue if there is none.
+ */
+cv::Mat FPEnhancement::ridge_freq(const cv::Mat &im, const cv::Mat &orientim) const {
+    int blockRows = (im.rows + freqBlockSize - 1) / freqBlockSize;
+    int blockCols = (im.cols + freqBlockSize - 1) / freqBlockSize;
+
+    // orient_ridge returns the angles in ddepth, while the blocks are read
+    // as float, as in filter_ridge
+    cv::Mat orientation = orientim;
+    if (orientation.type() != CV_32FC1) {
+        orientim.convertTo(orientation, CV_32FC1);
+    }
+
+    cv::Mat freq(blockRows, blockCols, CV_32FC1);
+    cv::Rect image(0, 0, im.cols, im.rows);
+
+    // Blocks are independent from each other
+    run_parallel(cv::Range(0, blockRows * blockCols), [&](const cv::Range &range) {
+        for (int k = range.start; k < range.end; k++) {
+            int by = k / blockCols;
+            int bx = k % blockCols;
+            cv::Rect block = cv::Rect(bx * freqBlockSize, by * freqBlockSize,
+                                      freqBlockSize, freqBlockSize) &
+                             image;
+            freq.at<float>(by, bx) = block_freq(im(block), orientation(block));
+        }
+    });
+
+    cv::vector<float> validFreqs;
+    for (int by = 0; by < blockRows; by++) {
+        const auto *freq_by = freq.ptr<float>(by);
+        for (int bx = 0; bx < blockCols; bx++) {
+            if (freq_by[bx] > 0) {
+                validFreqs.push_back(freq_by[bx]);
+            }
+        }
+    }
+
+    float fallback = freqValue;
+    if (!validFreqs.empty()) {
+        auto median = validFreqs.begin() + validFreqs.size() / 2;
+        std::nth_element(validFreqs.begin(), median, validFreqs.end());
+        fallback = *median;
+    }
+
+    freq.setTo(fallback, freq == 0);
+
+    return freq;
+}
 
-    for (int i = -kernelSize; i < kernelSize; i++) {
-        t.push_back(i);
+/*
+ * Estimate the ridge frequency of a single block using the x-signature
+ * method of the paper.
+ *
+ * The block is rotated so that ridges are vertical, then the grey values are
+ * projected down the ridges. The ridge period is the mean distance between
+ * the peaks of the projection. Returns 0 if no reliable frequency is found.
+ */
+float FPEnhancement::block_freq(const cv::Mat &block, const cv::Mat &orientBlock) {
+    // Size of the window used to find peaks in the projection
+    const int windowSize = 5;
+
+    int cropSize = (int) (std::min(block.rows, block.cols) / std::sqrt(2));
+    if (cropSize < 2 * windowSize) {
+        return 0;
+    }
+
+    // Mean orientation of the block, averaged on the doubled angles to
+    // avoid the wrap-around at pi
+    double sinSum = 0;
+    double cosSum = 0;
+    for (int i = 0; i < orientBlock.rows; i++) {
+        const auto *orientBlock_i = orientBlock.ptr<float>(i);
+        for (int j = 0; j < orientBlock.cols; j++) {
+            cosSum += std::cos(2 * orientBlock_i[j]);
+            sinSum += std::sin(2 * orientBlock_i[j]);
+        }
+    }
+    double orient = std::atan2(sinSum, cosSum) / 2;
+
+    // Rotate the block so that the ridges are vertical
+    cv::Mat rot_mat = cv::getRotationMatrix2D(
+            cv::Point2f((block.cols - 1) / 2.0F, (block.rows - 1) / 2.0F),
+            orient / M_PI * 180 + 90, 1.0);
+    cv::Mat rotated;
+    cv::warpAffine(block, rotated, rot_mat, block.size(), cv::INTER_NEAREST);
+
+    // Crop the block so that it does not contain any invalid region
+    cv::Rect crop((block.cols - cropSize) / 2, (block.rows - cropSize) / 2,
+                  cropSize, cropSize);
+    cv::Mat cropped = rotated(crop);
+
+    // Project the grey values down the ridges
+    cv::vector<float> proj(cropSize, 0.0f);
+    float projMean = 0;
+    for (int i = 0; i < cropSize; i++) {
+        const auto *cropped_i = cropped.ptr<float>(i);
+        for (int j = 0; j < cropSize; j++) {
+            proj[j] += cropped_i[j];
+        }
+    }
+    for (int j = 0; j < cropSize; j++) {
+        projMean += proj[j] / cropSize;
+    }
+
+    // Peaks are the local maxima above the mean
+    int firstPeak = -1;
+    int lastPeak = -1;
+    int peakCount = 0;
+    for (int j = 0; j < cropSize; j++) {
+        int from = std::max(j - windowSize / 2, 0);
+        int to = std::min(j + windowSize / 2, cropSize - 1);
+        float localMax = *std::max_element(proj.begin() + from, proj.begin() + to + 1);
+
+        if (proj[j] == localMax && proj[j] > projMean) {
+            if (firstPeak < 0) {
+                firstPeak = j;
+            }
+            lastPeak = j;
+            peakCount++;
+        }
+    }
+
+    if (peakCount < 2) {
+        return 0;
     }
 
-    cv::Mat gv = cv::Mat(t);
-    int total = gv.total();
-    gv = gv.reshape(1, 1);
+    double waveLength = (double) (lastPeak - firstPeak) / (peakCount - 1);
+    if (waveLength <= minWaveLength || waveLength >= maxWaveLength) {
+        return 0;
+    }
 
-    cv::repeat(gv, total, 1, meshX);
-    cv::repeat(gv.t(), 1, total, meshY);
+    return 1 / waveLength;
 }
 
 /*
  * Performing Gabor filtering for enhancement using previously calculated orientation
  * image and frequency. The output is final enhanced image.
  *
+ * `orientationImage` is the orientation in radians, or its CV_8UC1 index as
+ * returned by orient_ridge with `indexed` set.
+ * `frequency` is either empty, in which case freqValue is used everywhere,
+ * or a map of the frequency of each freqBlockSize x freqBlockSize block, as
+ * returned by ridge_freq. Only the non-zero pixels of `mask` are filtered,
+ * unless it is empty. The half size of the largest filter, i.e. the size of
+ * the unfiltered margin, is stored in `maxSzek` if given.
+ *
  * Refer to the paper for detailed description.
 */
-cv::Mat FPEnhancement::filter_ridge(const cv::Mat &inputImage,
-                                    const cv::Mat &orientationImage,
-                                    const cv::Mat &frequency) const {
+void FPEnhancement::filter_ridge(const cv::Mat &inputImage,
+                                 const cv::Mat &orientationImage,
+                                 const cv::Mat &frequency,
+                                 const cv::Mat &mask,
+                                 Workspace &workspace,
+                                 cv::Mat &enhancedImage,
+                                 int *maxSzek) const {
+
+    // Convert into a local header so the caller's matrices are never modified
+    cv::Mat input = inputImage;
+    if (input.type() != CV_32FC1) {
+        inputImage.convertTo(input, CV_32FC1);
+    }
+    int rows = input.rows;
+    int cols = input.cols;
 
-    // Fixed angle increment between filter orientations in degrees
-    int angleInc = 3;
+    // Ridges are either 0 or 255, so 8 bits are enough
+    enhancedImage.create(rows, cols, CV_8UC1);
+    enhancedImage.setTo(0);
 
-    inputImage.convertTo(inputImage, CV_32FC1);
-    int rows = inputImage.rows;
-    int cols = inputImage.cols;
+    PipelineStats::Clock::time_point start = PipelineStats::Clock::now();
 
-    orientationImage.convertTo(orientationImage, CV_32FC1);
+    FilterSelection selection;
+    select_filters(frequency, angleInc, selection);
+    selection.mask = mask;
+    start = PipelineStats::lap(workspace.stats.filterBank, start);
 
-    cv::Mat enhancedImage = cv::Mat::zeros(rows, cols, CV_32FC1);
-    cv::vector<int> validr;
-    cv::vector<int> validc;
+    // Convert orientation matrix values from radians to an index value that
+    // corresponds to round(degrees/angleInc), unless orient_ridge already did
+    int maxorientindex = selection.orientCount;
 
-    double unfreq = frequency.at<float>(1, 1);
+    cv::Mat orientation = orientationImage;
 
-    cv::Mat freqindex = cv::Mat::ones(100, 1, CV_32FC1);
+    if (orientation.type() == CV_8UC1) {
+        selection.orientindex = orientation;
+    } else {
+        if (orientation.type() != CV_32FC1) {
+            orientationImage.convertTo(orientation, CV_32FC1);
+        }
+        selection.orientindex = Workspace::view(workspace.orientindex, rows, cols, CV_8UC1);
+        cv::Mat &orientindex = selection.orientindex;
+
+        run_parallel(cv::Range(0, rows), [&](const cv::Range &range) {
+            for (int y = range.start; y < range.end; y++) {
+                const auto *orientation_y = orientation.ptr<float>(y);
+                auto *orientindex_y = orientindex.ptr<uchar>(y);
+                for (int x = 0; x < cols; x++) {
+                    int orientpix = static_cast<int>(
+                            std::round(orientation_y[x] / M_PI * 180 / angleInc));
+
+                    if (orientpix < 0) {
+                        orientpix += maxorientindex;
+                    }
+                    if (orientpix >= maxorientindex) {
+                        orientpix -= maxorientindex;
+                    }
+
+                    orientindex_y[x] = (uchar) orientpix;
+                }
+            }
+        });
+    }
 
-    double sigmax = (1 / unfreq) * kx;
-    double sigmax_squared = sigmax * sigmax;
-    double sigmay = (1 / unfreq) * ky;
-    double sigmay_squared = sigmay * sigmay;
+    // Pixels further than the largest filter from the image boundary
+    int szek = selection.maxSzek;
+    cv::Rect valid = valid_region(rows, cols, szek);
 
-    int szek = (int) round(3 * (std::max(sigmax, sigmay)));
+    // Finally, do the filtering
+    int backend = resolve_backend(2 * szek, selection.filters.size(), rows, cols);
+
+    if (valid.area() > 0) {
+        if (backend == GABOR_FFT) {
+            filter_ridge_fft(input, selection, valid, enhancedImage);
+        } else if (backend == GABOR_BLOCK) {
+            filter_ridge_block(input, orientation, selection, valid, enhancedImage);
+        } else {
+            // Only the sign of the responses is kept, so 16 bit pixels and
+            // taps are enough. Pixels beyond the limit are clamped.
+            bool fixed = fixedPoint;
+            cv::Mat fixedInput;
+            if (fixed) {
+                for (const std::shared_ptr<const GaborBank> &bank : selection.banks) {
+                    const cv::vector<cv::Mat> &fixedFilters = bank->fixedFilters();
+                    selection.fixedFilters.insert(selection.fixedFilters.end(), fixedFilters.begin(),
+                                                  fixedFilters.end());
+                }
+
+                fixedInput = Workspace::view(workspace.fixedInput, rows, cols, CV_16SC1);
+                input.convertTo(fixedInput, CV_16S, gabor::fixedInputScale);
+                cv::min(fixedInput, gabor::fixedInputLimit, fixedInput);
+                cv::max(fixedInput, -gabor::fixedInputLimit, fixedInput);
+            }
+
+            // Split the valid region in bands of rows processed in parallel
+            int bandCount = (valid.height + gaborBandHeight - 1) / gaborBandHeight;
+
+            run_parallel(cv::Range(0, bandCount), [&](const cv::Range &range) {
+                int y0 = valid.y + range.start * gaborBandHeight;
+                int y1 = std::min(valid.y + range.end * gaborBandHeight, valid.y + valid.height);
+                cv::Rect band(valid.x, y0, valid.width, y1 - y0);
+
+                if (backend == GABOR_BUCKETED && fixed) {
+                    filter_ridge_bucketed<short>(fixedInput, selection, band, *workspace.band(), enhancedImage);
+                } else if (backend == GABOR_BUCKETED) {
+                    filter_ridge_bucketed<float>(input, selection, band, *workspace.band(), enhancedImage);
+                } else if (fixed) {
+                    filter_ridge_direct<short>(fixedInput, selection, band, enhancedImage);
+                } else {
+                    filter_ridge_direct<float>(input, selection, band, enhancedImage);
+                }
+            });
+        }
+    }
 
-    cv::Mat meshX, meshY;
-    meshgrid(szek, meshX, meshY);
+    PipelineStats::lap(workspace.stats.gabor, start);
 
-    cv::Mat refFilter = cv::Mat::zeros(meshX.rows, meshX.cols, CV_32FC1);
+    if (maxSzek) {
+        *maxSzek = szek;
+    }
+}
 
-    meshX.convertTo(meshX, CV_32FC1);
-    meshY.convertTo(meshY, CV_32FC1);
+/*
+ * Add a border of the size of the unfiltered margin of filter_ridge.
+ */
+void FPEnhancement::add_border(cv::Mat &enhancedImage, int szek) {
+    int rows = enhancedImage.rows;
+    int cols = enhancedImage.cols;
+
+    enhancedImage.rowRange(0, rows).colRange(0, szek + 1).setTo(255);
+    enhancedImage.rowRange(0, szek + 1).colRange(0, cols).setTo(255);
+    enhancedImage.rowRange(rows - szek, rows).colRange(0, cols).setTo(255);
+    enhancedImage.rowRange(0, rows)
+            .colRange(cols - 2 * (szek + 1) - 1, cols)
+            .setTo(255);
+}
 
-    double pi_by_unfreq_by_2 = 2 * M_PI * unfreq;
+/*
+ * Gather the filter banks needed for the given frequency map.
+ *
+ * Frequencies are quantized to 0.01 so that a handful of banks covers the
+ * whole image. Banks are fetched lazily from the shared cache, and only
+ * for the frequencies which are actually present.
+ */
+void FPEnhancement::select_filters(const cv::Mat &frequency, int angleInc,
+                                   FilterSelection &selection) const {
+    cv::vector<double> bankFrequencies;
 
-    for (int i = 0; i < meshX.rows; i++) {
-        const float *meshX_i = meshX.ptr<float>(i);
-        const float *meshY_i = meshY.ptr<float>(i);
-        auto *reffilter_i = refFilter.ptr<float>(i);
-        for (int j = 0; j < meshX.cols; j++) {
-            float meshX_i_j = meshX_i[j];
-            float meshY_i_j = meshY_i[j];
-            float pixVal2 = -0.5f * (meshX_i_j * meshX_i_j / sigmax_squared +
-                                     meshY_i_j * meshY_i_j / sigmay_squared);
-            float pixVal = std::exp(pixVal2);
-            float cosVal = pi_by_unfreq_by_2 * meshX_i_j;
-            reffilter_i[j] = pixVal * std::cos(cosVal);
+    if (frequency.empty()) {
+        bankFrequencies.push_back(freqValue);
+    } else {
+        std::map<int, int> bankOfFrequency;
+        selection.blockBank.create(frequency.rows, frequency.cols, CV_8UC1);
+        selection.blockSize = freqBlockSize;
+
+        for (int by = 0; by < frequency.rows; by++) {
+            const auto *frequency_by = frequency.ptr<float>(by);
+            auto *blockBank_by = selection.blockBank.ptr<uchar>(by);
+            for (int bx = 0; bx < frequency.cols; bx++) {
+                int quantized = (int) std::round(frequency_by[bx] * 100);
+                auto it = bankOfFrequency.find(quantized);
+                if (it == bankOfFrequency.end()) {
+                    CV_Assert(bankFrequencies.size() < 256);
+                    it = bankOfFrequency.insert(std::make_pair(quantized, (int) bankFrequencies.size())).first;
+                    bankFrequencies.push_back(quantized / 100.0);
+                }
+                blockBank_by[bx] = (uchar) it->second;
+            }
         }
     }
 
-    cv::vector<cv::Mat> filters;
+    selection.orientCount = 180 / angleInc;
+    selection.maxSzek = 0;
 
-    for (int m = 0; m < 180 / angleInc; m++) {
-        double angle = -(m * angleInc + 90);
-        cv::Mat rot_mat =
-                cv::getRotationMatrix2D(cv::Point((float) (refFilter.rows / 2.0F),
-                                                  (float) (refFilter.cols / 2.0F)),
-                                        angle, 1.0);
-        cv::Mat rotResult;
-        cv::warpAffine(refFilter, rotResult, rot_mat, refFilter.size());
-        filters.push_back(rotResult);
+    for (double bankFrequency : bankFrequencies) {
+        std::shared_ptr<const GaborBank> bank = GaborBank::get(kx, ky, bankFrequency, angleInc);
+        selection.banks.push_back(bank);
+        selection.filters.insert(selection.filters.end(), bank->filters.begin(), bank->filters.end());
+        selection.maxSzek = std::max(selection.maxSzek, bank->szek);
     }
+}
 
-    // Find indices of matrix points greater than maxsze from the image boundary
-    int maxsze = szek;
-    // Convert orientation matrix values from radians to an index value that
-    // corresponds to round(degrees/angleInc)
-    int maxorientindex = std::round(180 / angleInc);
+/*
+ * Run `body` over `range`, split in stripes executed in parallel.
+ *
+ * numThreads = 1 runs everything on the calling thread, numThreads > 1 caps
+ * the number of stripes, and numThreads = 0 lets OpenCV decide. Within a
+ * batch, the stripes go to the scheduler of the batch instead, so that the
+ * threads done with their images help with this one.
+ */
+void FPEnhancement::run_parallel(const cv::Range &range,
+                                 const std::function<void(const cv::Range &)> &body) const {
+    if (numThreads == 1 || range.end - range.start <= 1) {
+        body(range);
+        return;
+    }
+
+    Scheduler *scheduler = Scheduler::current();
+    if (scheduler) {
+        scheduler->parallelFor(range, numThreads, body);
+        return;
+    }
 
-    cv::Mat orientindex(rows, cols, CV_32FC1);
+    cv::parallel_for_(range, body, numThreads > 0 ? numThreads : -1.);
+}
 
-    int rows_maxsze = rows - maxsze;
-    int cols_maxsze = cols - maxsze;
+/*
+ * Region of the pixels whose Gabor window lies inside the image, i.e. the
+ * pixels further than szek from the image boundary.
+ */
+cv::Rect FPEnhancement::valid_region(int rows, int cols, int szek) {
+    return cv::Rect(szek + 1, szek + 1,
+                    std::max(cols - 2 * szek - 1, 0),
+                    std::max(rows - 2 * szek - 1, 0));
+}
 
-    for (int y = 0; y < rows; y++) {
-        const auto *orientationImage_y = orientationImage.ptr<float>(y);
-        auto *orientindex_y = orientindex.ptr<float>(y);
-        for (int x = 0; x < cols; x++) {
-            if (x > maxsze && x < cols_maxsze && y > maxsze && y < rows_maxsze) {
-                validr.push_back(y);
-                validc.push_back(x);
+/*
+ * Resolve GABOR_AUTO into the backend to use for a given bank and image.
+ */
+int FPEnhancement::resolve_backend(int kernelSize, int filterCount,
+                                   int rows, int cols) const {
+    if (gaborBackend != GABOR_AUTO) {
+        return gaborBackend;
+    }
+
+    // The fixed point filtering is only implemented by the direct and
+    // bucketed backends
+    if (!fixedPoint && prefer_fft(kernelSize, filterCount, rows, cols)) {
+        return GABOR_FFT;
+    }
+
+    // Typical L1 data cache size
+    const size_t l1CacheSize = 32 * 1024;
+    size_t bankSize = (fixedPoint ? sizeof(short) : sizeof(float)) * kernelSize * kernelSize * filterCount;
+
+    return bankSize > l1CacheSize ? GABOR_BUCKETED : GABOR_DIRECT;
+}
+
+/*
+ * Rough cost model deciding whether the filter bank should be applied in
+ * the frequency domain.
+ *
+ * The direct evaluation costs one multiply-add per kernel tap and per pixel,
+ * while the FFT backend costs one forward and one inverse transform of the
+ * whole image per filter, i.e. O(log(rows * cols)) per pixel and per filter.
+ */
+bool FPEnhancement::prefer_fft(int kernelSize, int filterCount, int rows, int cols) {
+    // Relative cost of a real FFT butterfly against a vectorized multiply-add
+    const double fftCostFactor = 2.0;
+
+    double area = (double) cv::getOptimalDFTSize(rows) * cv::getOptimalDFTSize(cols);
+    if (area < 2) {
+        return false;
+    }
+
+    double directCost = (double) kernelSize * kernelSize;
+    double fftCost = fftCostFactor * filterCount * std::log2(area);
+
+    return fftCost < directCost;
+}
+
+/*
+ * Gabor filtering in the frequency domain.
+ *
+ * The spectrum of the image is computed once and reused for every filter
+ * of the bank. Each filter response is then cross-correlated through the
+ * spectrum product, and each pixel picks the response of its own filter.
+ *
+ * The response at pixel (r, c) is the same dot product as the direct
+ * evaluation, i.e. over the window whose top-left corner is
+ * (r - szek - 1, c - szek - 1) where szek is the half size of the filter.
+ */
+void FPEnhancement::filter_ridge_fft(const cv::Mat &inputImage,
+                                     const FilterSelection &selection,
+                                     const cv::Rect &valid,
+                                     cv::Mat &enhancedImage) const {
+    int rows = inputImage.rows;
+    int cols = inputImage.cols;
+    const cv::vector<cv::Mat> &filters = selection.filters;
+
+    // Valid pixels only read inside the image, so padding the image to a
+    // fast transform size is enough to avoid any wrap-around.
+    int dftRows = cv::getOptimalDFTSize(rows);
+    int dftCols = cv::getOptimalDFTSize(cols);
+
+    cv::Mat paddedImage;
+    cv::copyMakeBorder(inputImage, paddedImage, 0, dftRows - rows, 0, dftCols - cols,
+                       cv::BORDER_CONSTANT, cv::Scalar::all(0));
+
+    cv::Mat imageSpectrum;
+    cv::dft(paddedImage, imageSpectrum, 0, rows);
+
+    // Select the filter of each valid pixel, and only transform the filters
+    // which are actually used
+    cv::Mat filterindex(rows, cols, CV_32SC1, cv::Scalar::all(-1));
+    cv::vector<bool> used(filters.size(), false);
+    cv::vector<int> usedFilters;
+
+    for (int r = valid.y; r < valid.y + valid.height; r++) {
+        auto *filterindex_r = filterindex.ptr<int>(r);
+        for (int c = valid.x; c < valid.x + valid.width; c++) {
+            int k = selection.filterAt(r, c);
+            filterindex_r[c] = k;
+            if (k >= 0) {
+                used[k] = true;
             }
+        }
+    }
+
+    for (size_t m = 0; m < filters.size(); m++) {
+        if (used[m]) {
+            usedFilters.push_back((int) m);
+        }
+    }
 
-            int orientpix = static_cast<int>(
-                    std::round(orientationImage_y[x] / M_PI * 180 / angleInc));
+    if (usedFilters.empty()) {
+        return;
+    }
 
-            if (orientpix < 0) {
-                orientpix += maxorientindex;
+    // Each stripe holds a padded filter, its spectrum, the product and the
+    // response, all of the transform size. The number of stripes, hence of
+    // concurrent scratch sets, is capped by the memory budget, or by
+    // fftScratchBudget when there is none.
+    size_t stripeBytes = 4 * sizeof(float) * (size_t) dftRows * dftCols;
+    size_t budget = memoryBudget > 0 ? memoryBudget : fftScratchBudget;
+    int stripeCount = (int) std::min<size_t>(usedFilters.size(), std::max<size_t>(budget / stripeBytes, 1));
+
+    // The filters are processed in parallel. Each pixel is written by its
+    // own filter only, so the stripes never collide.
+    run_parallel(cv::Range(0, stripeCount), [&](const cv::Range &range) {
+        cv::Mat paddedFilter = cv::Mat::zeros(dftRows, dftCols, CV_32FC1);
+        cv::Mat filterSpectrum, product, response;
+
+        int first = (int) ((size_t) range.start * usedFilters.size() / stripeCount);
+        int last = (int) ((size_t) range.end * usedFilters.size() / stripeCount);
+        for (int u = first; u < last; u++) {
+            int m = usedFilters[u];
+
+            int kernelSize = filters[m].rows;
+            int szek = kernelSize / 2;
+
+            paddedFilter.setTo(0);
+            filters[m].copyTo(paddedFilter(cv::Rect(0, 0, kernelSize, kernelSize)));
+            cv::dft(paddedFilter, filterSpectrum, 0, kernelSize);
+
+            // Conjugating the filter spectrum gives a correlation
+            cv::mulSpectrums(imageSpectrum, filterSpectrum, product, 0, true);
+            cv::idft(product, response, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, rows);
+
+            for (int r = valid.y; r < valid.y + valid.height; r++) {
+                const auto *filterindex_r = filterindex.ptr<int>(r);
+                const auto *response_r = response.ptr<float>(r - szek - 1);
+                auto *enhancedImage_r = enhancedImage.ptr<uchar>(r);
+                for (int c = valid.x; c < valid.x + valid.width; c++) {
+                    if (filterindex_r[c] == m && response_r[c - szek - 1] > 0) {
+                        enhancedImage_r[c] = 255;
+                    }
+                }
             }
-            if (orientpix >= maxorientindex) {
-                orientpix -= maxorientindex;
+        }
+    });
+}
+
+/*
+ * Block-wise Gabor filtering.
+ *
+ * The orientation field is smooth, so each gaborBlockSize x gaborBlockSize
+ * tile of the valid region is filtered with a single kernel tuned for its
+ * dominant orientation. This is much faster than the per-pixel evaluation,
+ * at the price of slightly misaligned filters where the orientation changes
+ * quickly.
+ *
+ * Each tile is correlated with its kernel in the frequency domain, over the
+ * windows of the tile only. The spectrum of each kernel used is computed
+ * once, padded to the transform size of the tiles, and shared by its tiles.
+ */
+void FPEnhancement::filter_ridge_block(const cv::Mat &inputImage,
+                                       const cv::Mat &orientationImage,
+                                       const FilterSelection &selection,
+                                       const cv::Rect &valid,
+                                       cv::Mat &enhancedImage) const {
+    int tileRows = (valid.height + gaborBlockSize - 1) / gaborBlockSize;
+    int tileCols = (valid.width + gaborBlockSize - 1) / gaborBlockSize;
+    int tileCount = tileRows * tileCols;
+    cv::Rect image(0, 0, inputImage.cols, inputImage.rows);
+    double angleInc = 180.0 / selection.orientCount;
+    // The orientation is either in radians or an index of step radians
+    bool indexed = orientationImage.type() == CV_8UC1;
+    double step = M_PI / selection.orientCount;
+    const cv::vector<cv::Mat> &filters = selection.filters;
+
+    auto tile_of = [&](int k) {
+        return cv::Rect(valid.x + (k % tileCols) * gaborBlockSize, valid.y + (k / tileCols) * gaborBlockSize,
+                        gaborBlockSize, gaborBlockSize) &
+               valid;
+    };
+
+    // Filter of each tile, or -1 if it is masked out
+    cv::vector<int> tileFilter(tileCount, -1);
+
+    run_parallel(cv::Range(0, tileCount), [&](const cv::Range &range) {
+        for (int k = range.start; k < range.end; k++) {
+            cv::Rect tile = tile_of(k);
+
+            if (!selection.mask.empty() && cv::countNonZero(selection.mask(tile)) == 0) {
+                continue;
             }
 
-            orientindex_y[x] = orientpix;
+            // Dominant orientation of the tile, averaged on the doubled
+            // angles to avoid the wrap-around at pi
+            double sinSum = 0;
+            double cosSum = 0;
+            for (int r = tile.y; r < tile.y + tile.height; r++) {
+                for (int c = tile.x; c < tile.x + tile.width; c++) {
+                    double theta = indexed ? selection.orientindex.at<uchar>(r, c) * step
+                                           : orientationImage.at<float>(r, c);
+                    cosSum += std::cos(2 * theta);
+                    sinSum += std::sin(2 * theta);
+                }
+            }
+            double orient = std::atan2(sinSum, cosSum) / 2;
+
+            int orientpix = static_cast<int>(std::round(orient / M_PI * 180 / angleInc));
+            orientpix = ((orientpix % selection.orientCount) + selection.orientCount) % selection.orientCount;
+
+            // The frequency bank is the one of the center of the tile
+            int centerRow = tile.y + tile.height / 2;
+            int centerCol = tile.x + tile.width / 2;
+            int bank = selection.bankAt(centerRow, centerCol);
+
+            tileFilter[k] = bank * selection.orientCount + orientpix;
+        }
+    });
+
+    // The windows of a full tile fit in the transform size of its kernel,
+    // so the circular correlation never wraps around for the tile pixels
+    cv::vector<int> dftSizes(filters.size(), 0);
+    cv::vector<int> usedFilters;
+    for (int m : tileFilter) {
+        if (m >= 0 && dftSizes[m] == 0) {
+            dftSizes[m] = cv::getOptimalDFTSize(gaborBlockSize + filters[m].rows - 1);
+            usedFilters.push_back(m);
         }
     }
 
-    // Finally, do the filtering
-    for (int k = 0; k < validr.size(); k++) {
-        int r = validr[k];
-        int c = validc[k];
+    cv::vector<cv::Mat> filterSpectra(filters.size());
+    run_parallel(cv::Range(0, usedFilters.size()), [&](const cv::Range &range) {
+        for (int u = range.start; u < range.end; u++) {
+            int m = usedFilters[u];
+            int kernelSize = filters[m].rows;
+
+            cv::Mat paddedFilter = cv::Mat::zeros(dftSizes[m], dftSizes[m], CV_32FC1);
+            filters[m].copyTo(paddedFilter(cv::Rect(0, 0, kernelSize, kernelSize)));
+            cv::dft(paddedFilter, filterSpectra[m], 0, kernelSize);
+        }
+    });
+
+    run_parallel(cv::Range(0, tileCount), [&](const cv::Range &range) {
+        cv::Mat windows, windowSpectrum, product, response;
+
+        for (int k = range.start; k < range.end; k++) {
+            int m = tileFilter[k];
+            if (m < 0) {
+                continue;
+            }
+
+            cv::Rect tile = tile_of(k);
+            int szek = filters[m].rows / 2;
+
+            // The windows of the tile, anchored at (szek + 1, szek + 1) as
+            // in the per-pixel evaluation, are zero outside the image
+            cv::Rect extent(tile.x - szek - 1, tile.y - szek - 1, tile.width + 2 * szek, tile.height + 2 * szek);
+            cv::Rect inside = extent & image;
+            windows.create(dftSizes[m], dftSizes[m], CV_32FC1);
+            windows.setTo(0);
+            inputImage(inside).copyTo(windows(cv::Rect(inside.x - extent.x, inside.y - extent.y,
+                                                       inside.width, inside.height)));
+
+            // Conjugating the filter spectrum gives a correlation
+            cv::dft(windows, windowSpectrum, 0, extent.height);
+            cv::mulSpectrums(windowSpectrum, filterSpectra[m], product, 0, true);
+            cv::idft(product, response, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, tile.height);
+
+            for (int r = tile.y; r < tile.y + tile.height; r++) {
+                const auto *response_r = response.ptr<float>(r - tile.y);
+                const auto *mask_r = selection.mask.empty() ? nullptr : selection.mask.ptr<uchar>(r);
+                auto *enhancedImage_r = enhancedImage.ptr<uchar>(r);
+                for (int c = tile.x; c < tile.x + tile.width; c++) {
+                    if ((!mask_r || mask_r[c]) && response_r[c - tile.x] > 0) {
+                        enhancedImage_r[c] = 255;
+                    }
+                }
+            }
+        }
+    });
+}
+
+/*
+ * Filters matching the pixels of `inputImage`: the float ones, or the
+ * quantized ones for the fixed point filtering.
+ */
+template <typename T>
+static const cv::vector<cv::Mat> &filters_of(const cv::vector<cv::Mat> &filters,
+                                             const cv::vector<cv::Mat> &fixedFilters);
+
+template <>
+const cv::vector<cv::Mat> &filters_of<float>(const cv::vector<cv::Mat> &filters,
+                                             const cv::vector<cv::Mat> &fixedFilters) {
+    return filters;
+}
+
+template <>
+const cv::vector<cv::Mat> &filters_of<short>(const cv::vector<cv::Mat> &filters,
+                                             const cv::vector<cv::Mat> &fixedFilters) {
+    return fixedFilters;
+}
 
-        cv::Rect roi(c - szek - 1, r - szek - 1, meshX.cols, meshX.rows);
-        cv::Mat subim(inputImage(roi));
+/*
+ * Gabor filtering of the pixels of `region`, each one evaluated with its
+ * own filter.
+ */
+template <typename T>
+void FPEnhancement::filter_ridge_direct(const cv::Mat &inputImage,
+                                        const FilterSelection &selection,
+                                        const cv::Rect &region,
+                                        cv::Mat &enhancedImage) {
+    // The windowed dot product is computed directly on the image rows,
+    // without any temporary.
+    const size_t inputStep = inputImage.step1();
+    const cv::vector<cv::Mat> &filters = filters_of<T>(selection.filters, selection.fixedFilters);
+
+    for (int r = region.y; r < region.y + region.height; r++) {
+        auto *enhancedImage_r = enhancedImage.ptr<uchar>(r);
+        for (int c = region.x; c < region.x + region.width; c++) {
+            int k = selection.filterAt(r, c);
+            if (k < 0) {
+                continue;
+            }
 
-        cv::Mat subFilter = filters.at(orientindex.at<float>(r, c));
-        cv::Mat mulResult;
-        cv::multiply(subim, subFilter, mulResult);
+            const cv::Mat &subFilter = filters[k];
+            int szek = subFilter.rows / 2;
+            const T *window = inputImage.ptr<T>(r - szek - 1) + (c - szek - 1);
 
-        if (cv::sum(mulResult)[0] > 0) {
-            enhancedImage.at<float>(r, c) = 255;
+            if (gabor::windowDot(window, inputStep, subFilter.ptr<T>(),
+                                 subFilter.rows, subFilter.cols) > 0) {
+                enhancedImage_r[c] = 255;
+            }
         }
     }
+}
 
-    // Add a border.
-    if (addBorder) {
-        enhancedImage.rowRange(0, rows).colRange(0, szek + 1).setTo(255);
-        enhancedImage.rowRange(0, szek + 1).colRange(0, cols).setTo(255);
-        enhancedImage.rowRange(rows - szek, rows).colRange(0, cols).setTo(255);
-        enhancedImage.rowRange(0, rows)
-                .colRange(cols - 2 * (szek + 1) - 1, cols)
-                .setTo(255);
+/*
+ * Gabor filtering with the pixels grouped by filter.
+ *
+ * `region` is processed in bands of rows. The pixels of a band are
+ * bucketed by filter index with a counting sort, then each bucket is
+ * evaluated with its filter, which thus stays in cache for the whole bucket
+ * instead of alternating between the filters of neighbouring pixels.
+ */
+template <typename T>
+void FPEnhancement::filter_ridge_bucketed(const cv::Mat &inputImage,
+                                          const FilterSelection &selection,
+                                          const cv::Rect &region,
+                                          Workspace::Band &buffers,
+                                          cv::Mat &enhancedImage) {
+    const int bandHeight = gaborBandHeight;
+    const size_t inputStep = inputImage.step1();
+    const cv::vector<cv::Mat> &filters = filters_of<T>(selection.filters, selection.fixedFilters);
+    const int filterCount = filters.size();
+
+    cv::vector<int> &bucketStart = buffers.bucketStart;
+    cv::vector<int> &bucketEnd = buffers.bucketEnd;
+    cv::vector<cv::Point> &bucketed = buffers.bucketed;
+    cv::vector<int> &bandFilters = buffers.bandFilters;
+    bucketStart.resize(filterCount + 1);
+    bucketEnd.resize(filterCount);
+    bucketed.resize(bandHeight * region.width);
+    bandFilters.resize(bandHeight * region.width);
+
+    for (int y0 = region.y; y0 < region.y + region.height; y0 += bandHeight) {
+        int y1 = std::min(y0 + bandHeight, region.y + region.height);
+
+        // Counting sort of the pixels of the band by filter
+        std::fill(bucketStart.begin(), bucketStart.end(), 0);
+        for (int r = y0, k = 0; r < y1; r++) {
+            for (int c = region.x; c < region.x + region.width; c++, k++) {
+                // Masked out pixels are counted at the front of the array
+                // and never evaluated
+                bandFilters[k] = selection.filterAt(r, c);
+                bucketStart[bandFilters[k] + 1]++;
+            }
+        }
+
+        for (int m = 0; m < filterCount; m++) {
+            bucketStart[m + 1] += bucketStart[m];
+            bucketEnd[m] = bucketStart[m];
+        }
+
+        for (int r = y0, k = 0; r < y1; r++) {
+            for (int c = region.x; c < region.x + region.width; c++, k++) {
+                if (bandFilters[k] >= 0) {
+                    bucketed[bucketEnd[bandFilters[k]]++] = cv::Point(c, r);
+                }
+            }
+        }
+
+        // Evaluate each bucket with its own filter and scatter the results
+        for (int m = 0; m < filterCount; m++) {
+            const cv::Mat &filter = filters[m];
+            const T *kernel = filter.ptr<T>();
+            int szek = filter.rows / 2;
+
+            for (int k = bucketStart[m]; k < bucketStart[m + 1]; k++) {
+                const cv::Point &p = bucketed[k];
+                const T *window = inputImage.ptr<T>(p.y - szek - 1) + (p.x - szek - 1);
+
+                if (gabor::windowDot(window, inputStep, kernel, filter.rows, filter.cols) > 0) {
+                    enhancedImage.at<uchar>(p.y, p.x) = 255;
+                }
+            }
+        }
     }
+}
 
-    return enhancedImage;
-}
\ No newline at end of file
+/*
+ * Pack a ridge map into 1 bit per pixel.
+ *
+ * Each row is packed into ceil(cols / 8) bytes, the most significant bit
+ * being the leftmost pixel, which is the layout of numpy.packbits(axis=1).
+ * Non-zero pixels are set bits.
+ */
+cv::Mat FPEnhancement::packRidgeMap(const cv::Mat &ridgeMap) {
+    CV_Assert(ridgeMap.type() == CV_8UC1);
+
+    int packedCols = (ridgeMap.cols + 7) / 8;
+    cv::Mat packed = cv::Mat::zeros(ridgeMap.rows, packedCols, CV_8UC1);
+
+    for (int i = 0; i < ridgeMap.rows; i++) {
+        const auto *ridgeMap_i = ridgeMap.ptr<uchar>(i);
+        auto *packed_i = packed.ptr<uchar>(i);
+        for (int j = 0; j < ridgeMap.cols; j++) {
+            if (ridgeMap_i[j]) {
+                packed_i[j >> 3] |= (uchar) (0x80 >> (j & 7));
+            }
+        }
+    }
+
+    return packed;
+}
+
+/*
+ * Unpack a ridge map packed by packRidgeMap into a CV_8UC1 image of `cols`
+ * columns holding 0 or 255.
+ */
+cv::Mat FPEnhancement::unpackRidgeMap(const cv::Mat &packed, int cols) {
+    CV_Assert(packed.type() == CV_8UC1 && packed.cols == (cols + 7) / 8);
+
+    cv::Mat ridgeMap(packed.rows, cols, CV_8UC1);
+
+    for (int i = 0; i < packed.rows; i++) {
+        const auto *packed_i = packed.ptr<uchar>(i);
+        auto *ridgeMap_i = ridgeMap.ptr<uchar>(i);
+        for (int j = 0; j < cols; j++) {
+            ridgeMap_i[j] = (packed_i[j >> 3] & (0x80 >> (j & 7))) ? 255 : 0;
+        }
+    }
+
+    return ridgeMap;
+}
@@ -0,0 +1,157 @@
+// Author: Ekberjan Derman
+// Contributor : Baptiste Amato, Julien Jerphanion
+// Emails:
+//    ekberjanderman@gmail.com
+//    baptiste.amato@psycle.io
+//    git@jjerphan.xyz
+
+#include "gabor_bank.h"
+#include "gabor_kernels.h"
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace {
+    typedef std::tuple<double, double, double, int> BankKey;
+
+    std::mutex cacheMutex;
+    std::map<BankKey, std::shared_ptr<const GaborBank>> cache;
+}
+
+std::shared_ptr<const GaborBank> GaborBank::get(double kx, double ky,
+                                                double frequency, int angleInc) {
+    // The orientations of the bank wrap around at 180 degrees
+    CV_Assert(angleInc > 0 && 180 % angleInc == 0);
+
+    BankKey key(kx, ky, frequency, angleInc);
+
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+
+    // Build without holding the lock so that other banks stay available.
+    // If another thread built the same bank meanwhile, keep the first one.
+    std::shared_ptr<const GaborBank> bank = build(kx, ky, frequency, angleInc);
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return cache.insert(std::make_pair(key, bank)).first->second;
+}
+
+void GaborBank::clearCache() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    cache.clear();
+}
+
+/*
+ * Build the reference Gabor filter for the given frequency and rotate it
+ * into every orientation.
+ */
+std::shared_ptr<const GaborBank> GaborBank::build(double kx, double ky,
+                                                  double frequency, int angleInc) {
+    double sigmax = (1 / frequency) * kx;
+    double sigmax_squared = sigmax * sigmax;
+    double sigmay = (1 / frequency) * ky;
+    double sigmay_squared = sigmay * sigmay;
+
+    int szek = (int) round(3 * (std::max(sigmax, sigmay)));
+
+    cv::Mat meshX, meshY;
+    meshgrid(szek, meshX, meshY);
+
+    cv::Mat refFilter = cv::Mat::zeros(meshX.rows, meshX.cols, CV_32FC1);
+
+    meshX.convertTo(meshX, CV_32FC1);
+    meshY.convertTo(meshY, CV_32FC1);
+
+    double pi_by_unfreq_by_2 = 2 * M_PI * frequency;
+
+    for (int i = 0; i < meshX.rows; i++) {
+        const float *meshX_i = meshX.ptr<float>(i);
+        const float *meshY_i = meshY.ptr<float>(i);
+        auto *reffilter_i = refFilter.ptr<float>(i);
+        for (int j = 0; j < meshX.cols; j++) {
+            float meshX_i_j = meshX_i[j];
+            float meshY_i_j = meshY_i[j];
+            float pixVal2 = -0.5f * (meshX_i_j * meshX_i_j / sigmax_squared +
+                                     meshY_i_j * meshY_i_j / sigmay_squared);
+            float pixVal = std::exp(pixVal2);
+            float cosVal = pi_by_unfreq_by_2 * meshX_i_j;
+            reffilter_i[j] = pixVal * std::cos(cosVal);
+        }
+    }
+
+    cv::vector<cv::Mat> filters;
+
+    for (int m = 0; m < 180 / angleInc; m++) {
+        double angle = -(m * angleInc + 90);
+        cv::Mat rot_mat =
+                cv::getRotationMatrix2D(cv::Point((float) (refFilter.rows / 2.0F),
+                                                  (float) (refFilter.cols / 2.0F)),
+                                        angle, 1.0);
+        cv::Mat rotResult;
+        cv::warpAffine(refFilter, rotResult, rot_mat, refFilter.size());
+        filters.push_back(rotResult);
+    }
+
+    return std::shared_ptr<const GaborBank>(new GaborBank(szek, std::move(filters)));
+}
+
+const cv::vector<cv::Mat> &GaborBank::fixedFilters() const {
+    std::call_once(quantizeOnce, [this]() { quantizedFilters = quantize(filters); });
+    return quantizedFilters;
+}
+
+/*
+ * Quantize the filters to 16 bits with a common scale, as large as possible
+ * while the response of any window of fixed point pixels, which are bounded
+ * by gabor::fixedInputLimit, fits in 32 bits.
+ */
+cv::vector<cv::Mat> GaborBank::quantize(const cv::vector<cv::Mat> &filters) {
+    double maxTap = 0;
+    double maxSum = 0;
+    size_t taps = 0;
+
+    for (const cv::Mat &filter : filters) {
+        double minValue, maxValue;
+        cv::minMaxLoc(filter, &minValue, &maxValue);
+        maxTap = std::max(maxTap, std::max(-minValue, maxValue));
+        maxSum = std::max(maxSum, cv::norm(filter, cv::NORM_L1));
+        taps = std::max(taps, filter.total());
+    }
+
+    // Rounding adds at most half a unit to each tap
+    double accumulatorLimit = (double) INT32_MAX / gabor::fixedInputLimit - 0.5 * taps;
+    double scale = std::min(INT16_MAX / maxTap, accumulatorLimit / maxSum);
+
+    cv::vector<cv::Mat> fixedFilters(filters.size());
+    for (size_t m = 0; m < filters.size(); m++) {
+        filters[m].convertTo(fixedFilters[m], CV_16SC1, scale);
+    }
+
+    return fixedFilters;
+}
+
+/*
+ * This is equivalent to Matlab's 'meshgrid' function
+*/
+void GaborBank::meshgrid(int kernelSize, cv::Mat &meshX, cv::Mat &meshY) {
+    std::vector<int> t;
+
+    for (int i = -kernelSize; i < kernelSize; i++) {
+        t.push_back(i);
+    }
+
+    cv::Mat gv = cv::Mat(t);
+    int total = gv.total();
+    gv = gv.reshape(1, 1);
+
+    cv::repeat(gv, total, 1, meshX);
+    cv::repeat(gv.t(), 1, total, meshY);
+}
@@ -0,0 +1,390 @@
+// Author: Ekberjan Derman
+// Contributor : Baptiste Amato, Julien Jerphanion
+// Emails:
+//    ekberjanderman@gmail.com
+//    baptiste.amato@psycle.io
+//    git@jjerphan.xyz
+
+#include "gabor_kernels.h"
+
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace gabor {
+
+    // Minimax coefficients of atan(a) / a as a polynomial of a^2 on [0, 1]
+    static const float atanCoefficients[] = {0.99997726f, -0.33262347f, 0.19354346f,
+                                              -0.11643287f, 0.05265332f, -0.01172120f};
+
+    static const float halfPi = 1.57079632679489662f;
+    static const float pi = 3.14159265358979324f;
+
+    static inline float fastAtan2(float y, float x) {
+        float ax = std::fabs(x);
+        float ay = std::fabs(y);
+        float hi = ax > ay ? ax : ay;
+        float lo = ax > ay ? ay : ax;
+        float a = hi > 0 ? lo / hi : 0.0f;
+        float s = a * a;
+
+        float r = atanCoefficients[5];
+        for (int k = 4; k >= 0; k--) {
+            r = r * s + atanCoefficients[k];
+        }
+        r *= a;
+
+        if (ay > ax) {
+            r = halfPi - r;
+        }
+        if (x < 0) {
+            r = pi - r;
+        }
+        return y < 0 ? -r : r;
+    }
+
+#if defined(__SSE2__)
+    static inline int horizontalSum(__m128i v) {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+    }
+#endif
+
+#if defined(__AVX2__)
+    static inline float horizontalSum(__m256 v) {
+        __m128 lo = _mm256_castps256_ps128(v);
+        __m128 hi = _mm256_extractf128_ps(v, 1);
+        lo = _mm_add_ps(lo, hi);
+        lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+        lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+        return _mm_cvtss_f32(lo);
+    }
+
+    static inline __m256 multiplyAdd(__m256 a, __m256 b, __m256 acc) {
+#if defined(__FMA__)
+        return _mm256_fmadd_ps(a, b, acc);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), acc);
+#endif
+    }
+
+    // Vector version of fastAtan2
+    static inline __m256 fastAtan2(__m256 y, __m256 x) {
+        const __m256 signMask = _mm256_set1_ps(-0.0f);
+        __m256 ax = _mm256_andnot_ps(signMask, x);
+        __m256 ay = _mm256_andnot_ps(signMask, y);
+        __m256 hi = _mm256_max_ps(ax, ay);
+        __m256 lo = _mm256_min_ps(ax, ay);
+
+        // 0 / 0 is NaN, which is replaced by 0
+        __m256 nonZero = _mm256_cmp_ps(hi, _mm256_setzero_ps(), _CMP_GT_OQ);
+        __m256 a = _mm256_and_ps(_mm256_div_ps(lo, hi), nonZero);
+        __m256 s = _mm256_mul_ps(a, a);
+
+        __m256 r = _mm256_set1_ps(atanCoefficients[5]);
+        for (int k = 4; k >= 0; k--) {
+            r = multiplyAdd(r, s, _mm256_set1_ps(atanCoefficients[k]));
+        }
+        r = _mm256_mul_ps(r, a);
+
+        r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(halfPi), r),
+                             _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+        r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(pi), r),
+                             _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+        return _mm256_xor_ps(r, _mm256_and_ps(_mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_LT_OQ), signMask));
+    }
+#elif defined(__SSE2__)
+    static inline float horizontalSum(__m128 v) {
+        v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 0x55));
+        return _mm_cvtss_f32(v);
+    }
+
+    static inline __m128 select(__m128 condition, __m128 a, __m128 b) {
+        return _mm_or_ps(_mm_and_ps(condition, a), _mm_andnot_ps(condition, b));
+    }
+
+    // Vector version of fastAtan2
+    static inline __m128 fastAtan2(__m128 y, __m128 x) {
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        __m128 ax = _mm_andnot_ps(signMask, x);
+        __m128 ay = _mm_andnot_ps(signMask, y);
+        __m128 hi = _mm_max_ps(ax, ay);
+        __m128 lo = _mm_min_ps(ax, ay);
+
+        // 0 / 0 is NaN, which is replaced by 0
+        __m128 nonZero = _mm_cmpgt_ps(hi, _mm_setzero_ps());
+        __m128 a = _mm_and_ps(_mm_div_ps(lo, hi), nonZero);
+        __m128 s = _mm_mul_ps(a, a);
+
+        __m128 r = _mm_set1_ps(atanCoefficients[5]);
+        for (int k = 4; k >= 0; k--) {
+            r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(atanCoefficients[k]));
+        }
+        r = _mm_mul_ps(r, a);
+
+        r = select(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(halfPi), r), r);
+        r = select(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(pi), r), r);
+        return _mm_xor_ps(r, _mm_and_ps(_mm_cmplt_ps(y, _mm_setzero_ps()), signMask));
+    }
+#endif
+
+    template <int Size>
+    static inline float window_dot(const float *window, size_t windowStep,
+                                 const float *kernel, int kernelRows, int kernelCols) {
+        // Compile time bounds for the specialized sizes, so that the loops
+        // are fully unrolled
+        const int rows = Size > 0 ? Size : kernelRows;
+        const int cols = Size > 0 ? Size : kernelCols;
+        float tail = 0.0f;
+
+#if defined(__AVX2__)
+        // Two accumulators to hide the latency of the multiply-add chain
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+
+        for (int i = 0; i < rows; i++) {
+            const float *src_i = window + i * windowStep;
+            const float *kernel_i = kernel + i * cols;
+            int j = 0;
+            for (; j + 16 <= cols; j += 16) {
+                acc0 = multiplyAdd(_mm256_loadu_ps(src_i + j), _mm256_loadu_ps(kernel_i + j), acc0);
+                acc1 = multiplyAdd(_mm256_loadu_ps(src_i + j + 8), _mm256_loadu_ps(kernel_i + j + 8), acc1);
+            }
+            for (; j + 8 <= cols; j += 8) {
+                acc0 = multiplyAdd(_mm256_loadu_ps(src_i + j), _mm256_loadu_ps(kernel_i + j), acc0);
+            }
+            for (; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        return horizontalSum(_mm256_add_ps(acc0, acc1)) + tail;
+#elif defined(__SSE2__)
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+
+        for (int i = 0; i < rows; i++) {
+            const float *src_i = window + i * windowStep;
+            const float *kernel_i = kernel + i * cols;
+            int j = 0;
+            for (; j + 8 <= cols; j += 8) {
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(src_i + j), _mm_loadu_ps(kernel_i + j)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(src_i + j + 4), _mm_loadu_ps(kernel_i + j + 4)));
+            }
+            for (; j + 4 <= cols; j += 4) {
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(src_i + j), _mm_loadu_ps(kernel_i + j)));
+            }
+            for (; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        return horizontalSum(_mm_add_ps(acc0, acc1)) + tail;
+#else
+        for (int i = 0; i < rows; i++) {
+            const float *src_i = window + i * windowStep;
+            const float *kernel_i = kernel + i * cols;
+            for (int j = 0; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        return tail;
+#endif
+    }
+
+    template <int Size>
+    static inline int window_dot(const short *window, size_t windowStep,
+                                 const short *kernel, int kernelRows, int kernelCols) {
+        // Compile time bounds for the specialized sizes, so that the loops
+        // are fully unrolled
+        const int rows = Size > 0 ? Size : kernelRows;
+        const int cols = Size > 0 ? Size : kernelCols;
+        int tail = 0;
+
+#if defined(__AVX2__)
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        __m128i acc2 = _mm_setzero_si128();
+
+        for (int i = 0; i < rows; i++) {
+            const short *src_i = window + i * windowStep;
+            const short *kernel_i = kernel + i * cols;
+            int j = 0;
+            for (; j + 32 <= cols; j += 32) {
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+                        _mm256_loadu_si256((const __m256i *) (src_i + j)),
+                        _mm256_loadu_si256((const __m256i *) (kernel_i + j))));
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(
+                        _mm256_loadu_si256((const __m256i *) (src_i + j + 16)),
+                        _mm256_loadu_si256((const __m256i *) (kernel_i + j + 16))));
+            }
+            for (; j + 16 <= cols; j += 16) {
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+                        _mm256_loadu_si256((const __m256i *) (src_i + j)),
+                        _mm256_loadu_si256((const __m256i *) (kernel_i + j))));
+            }
+            for (; j + 8 <= cols; j += 8) {
+                acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (src_i + j)),
+                                                          _mm_loadu_si128((const __m128i *) (kernel_i + j))));
+            }
+            for (; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        acc0 = _mm256_add_epi32(acc0, acc1);
+        return horizontalSum(_mm_add_epi32(acc2, _mm_add_epi32(_mm256_castsi256_si128(acc0),
+                                                               _mm256_extracti128_si256(acc0, 1)))) + tail;
+#elif defined(__SSE2__)
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+
+        for (int i = 0; i < rows; i++) {
+            const short *src_i = window + i * windowStep;
+            const short *kernel_i = kernel + i * cols;
+            int j = 0;
+            for (; j + 16 <= cols; j += 16) {
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (src_i + j)),
+                                                          _mm_loadu_si128((const __m128i *) (kernel_i + j))));
+                acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (src_i + j + 8)),
+                                                          _mm_loadu_si128((const __m128i *) (kernel_i + j + 8))));
+            }
+            for (; j + 8 <= cols; j += 8) {
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (src_i + j)),
+                                                          _mm_loadu_si128((const __m128i *) (kernel_i + j))));
+            }
+            for (; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        return horizontalSum(_mm_add_epi32(acc0, acc1)) + tail;
+#else
+        for (int i = 0; i < rows; i++) {
+            const short *src_i = window + i * windowStep;
+            const short *kernel_i = kernel + i * cols;
+            for (int j = 0; j < cols; j++) {
+                tail += src_i[j] * kernel_i[j];
+            }
+        }
+
+        return tail;
+#endif
+    }
+
+    /*
+     * Run the window_dot specialized for the size of the kernel, if any.
+     * The specialized sizes are the windows 2 * szek of the default
+     * kx = ky = 0.8 for the ridge frequencies 0.10 to 0.13, which covers the
+     * default freqValue of 0.11 and most of the estimated frequencies.
+     */
+    template <typename T, typename R>
+    static inline R dispatch_window_dot(const T *window, size_t windowStep,
+                                        const T *kernel, int kernelRows, int kernelCols) {
+        if (kernelRows == kernelCols) {
+            switch (kernelCols) {
+                case 36:
+                    return window_dot<36>(window, windowStep, kernel, kernelRows, kernelCols);
+                case 40:
+                    return window_dot<40>(window, windowStep, kernel, kernelRows, kernelCols);
+                case 44:
+                    return window_dot<44>(window, windowStep, kernel, kernelRows, kernelCols);
+                case 48:
+                    return window_dot<48>(window, windowStep, kernel, kernelRows, kernelCols);
+                default:
+                    break;
+            }
+        }
+
+        return window_dot<0>(window, windowStep, kernel, kernelRows, kernelCols);
+    }
+
+    float windowDot(const float *window, size_t windowStep,
+                    const float *kernel, int kernelRows, int kernelCols) {
+        return dispatch_window_dot<float, float>(window, windowStep, kernel, kernelRows, kernelCols);
+    }
+
+    int windowDot(const short *window, size_t windowStep,
+                  const short *kernel, int kernelRows, int kernelCols) {
+        return dispatch_window_dot<short, int>(window, windowStep, kernel, kernelRows, kernelCols);
+    }
+
+    void orientationAngles(const float *sin2theta, const float *cos2theta,
+                           float *orientation, int n) {
+        int i = 0;
+
+#if defined(__AVX2__)
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 offset = _mm256_set1_ps(halfPi);
+        for (; i + 8 <= n; i += 8) {
+            __m256 angle = fastAtan2(_mm256_loadu_ps(sin2theta + i), _mm256_loadu_ps(cos2theta + i));
+            _mm256_storeu_ps(orientation + i, multiplyAdd(angle, half, offset));
+        }
+#elif defined(__SSE2__)
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 offset = _mm_set1_ps(halfPi);
+        for (; i + 4 <= n; i += 4) {
+            __m128 angle = fastAtan2(_mm_loadu_ps(sin2theta + i), _mm_loadu_ps(cos2theta + i));
+            _mm_storeu_ps(orientation + i, _mm_add_ps(_mm_mul_ps(angle, half), offset));
+        }
+#endif
+
+        for (; i < n; i++) {
+            orientation[i] = fastAtan2(sin2theta[i], cos2theta[i]) * 0.5f + halfPi;
+        }
+    }
+
+    void orientationIndices(const float *sin2theta, const float *cos2theta,
+                            unsigned char *index, int n, int orientCount) {
+        // The orientation is (pi + angle) / 2, so its index before rounding
+        // is angle * scale + orientCount / 2
+        float scale = orientCount / (2 * pi);
+        float offset = orientCount / 2.0f + 0.5f;
+        int i = 0;
+
+#if defined(__AVX2__)
+        const __m256 scaleVector = _mm256_set1_ps(scale);
+        const __m256 offsetVector = _mm256_set1_ps(offset);
+        const __m256i countVector = _mm256_set1_epi32(orientCount);
+        for (; i + 8 <= n; i += 8) {
+            __m256 angle = fastAtan2(_mm256_loadu_ps(sin2theta + i), _mm256_loadu_ps(cos2theta + i));
+            __m256i k = _mm256_cvttps_epi32(multiplyAdd(angle, scaleVector, offsetVector));
+            // Only orientCount itself, i.e. an orientation of pi, wraps around
+            k = _mm256_sub_epi32(k, _mm256_andnot_si256(_mm256_cmpgt_epi32(countVector, k), countVector));
+
+            // Pack the 8 indices to bytes
+            __m128i k16 = _mm_packs_epi32(_mm256_castsi256_si128(k), _mm256_extracti128_si256(k, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(index + i), _mm_packus_epi16(k16, k16));
+        }
+#elif defined(__SSE2__)
+        const __m128 scaleVector = _mm_set1_ps(scale);
+        const __m128 offsetVector = _mm_set1_ps(offset);
+        const __m128i countVector = _mm_set1_epi32(orientCount);
+        for (; i + 8 <= n; i += 8) {
+            __m128i k[2];
+            for (int h = 0; h < 2; h++) {
+                __m128 angle = fastAtan2(_mm_loadu_ps(sin2theta + i + 4 * h), _mm_loadu_ps(cos2theta + i + 4 * h));
+                k[h] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(angle, scaleVector), offsetVector));
+                // Only orientCount itself, i.e. an orientation of pi, wraps around
+                k[h] = _mm_sub_epi32(k[h], _mm_andnot_si128(_mm_cmpgt_epi32(countVector, k[h]), countVector));
+            }
+
+            __m128i k16 = _mm_packs_epi32(k[0], k[1]);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(index + i), _mm_packus_epi16(k16, k16));
+        }
+#endif
+
+        for (; i < n; i++) {
+            int k = static_cast<int>(fastAtan2(sin2theta[i], cos2theta[i]) * scale + offset);
+            index[i] = static_cast<unsigned char>(k >= orientCount ? k - orientCount : k);
+        }
+    }
+
+}
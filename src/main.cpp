@@ -16,6 +16,13 @@
 #include "cxxopts.hpp"
 #include "fpenhancement.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <thread>
+
 std::string getImageType(int number) {
     // Find type
     int imgTypeInt = number % 8;
@@ -56,6 +63,393 @@ std::string getImageType(int number) {
     return type.str();
 }
 
+/*
+ * Print the stage timings of the last extraction as JSON.
+ */
+void printProfile(const PipelineStats &stats) {
+    std::cout << "{\"blur_ms\": " << stats.blur
+              << ", \"normalization_ms\": " << stats.normalization
+              << ", \"orientation_ms\": " << stats.orientation
+              << ", \"frequency_ms\": " << stats.frequency
+              << ", \"filter_bank_ms\": " << stats.filterBank
+              << ", \"gabor_ms\": " << stats.gabor
+              << ", \"post_processing_ms\": " << stats.postProcessing
+              << ", \"total_ms\": " << stats.total << "}" << std::endl;
+}
+
+/*
+ * Parameters of the extractor with the library defaults. The benchmarks and
+ * the CLI only override the parameters they vary.
+ */
+FPEnhancement::Parameters defaultParameters() {
+    return FPEnhancement().parameters();
+}
+
+double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+/*
+ * Median duration in milliseconds of `repeat` runs of `run`, after a first
+ * warm up run.
+ */
+double medianTime(const std::function<void()> &run, int repeat) {
+    run();
+
+    std::vector<double> times;
+    for (int i = 0; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+
+    return median(times);
+}
+
+/*
+ * Time the orientation field at every pyramid level, and compare it with
+ * the full resolution one.
+ */
+void benchmarkOrientation(const cv::Mat &input, int repeat) {
+    const int scales[] = {1, 2, 4};
+    cv::Mat reference;
+    double referenceTime = 0;
+
+    std::cout << "scale  time (ms)  speedup  mean error (deg)  p95 error (deg)" << std::endl;
+
+    for (int scale : scales) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.orientationScale = scale;
+        FPEnhancement fpEnhancement(parameters);
+
+        cv::Mat orientation;
+        double time = medianTime([&]() { orientation = fpEnhancement.orientationField(input); }, repeat);
+
+        if (scale == 1) {
+            reference = orientation;
+            referenceTime = time;
+        }
+
+        // Angular distance between orientations, which wrap around at pi
+        std::vector<float> errors;
+        errors.reserve(orientation.total());
+        for (int i = 0; i < orientation.rows; i++) {
+            const auto *orientation_i = orientation.ptr<float>(i);
+            const auto *reference_i = reference.ptr<float>(i);
+            for (int j = 0; j < orientation.cols; j++) {
+                float error = std::fmod(std::fabs(orientation_i[j] - reference_i[j]), (float) M_PI);
+                errors.push_back(std::min(error, (float) M_PI - error) * 180 / (float) M_PI);
+            }
+        }
+
+        double meanError = 0;
+        for (float error : errors) {
+            meanError += error;
+        }
+        meanError /= errors.size();
+
+        std::nth_element(errors.begin(), errors.begin() + errors.size() * 95 / 100, errors.end());
+        float p95Error = errors[errors.size() * 95 / 100];
+
+        std::cout << std::fixed << std::setprecision(2) << std::setw(5) << scale << std::setw(11) << time
+                  << std::setw(9) << referenceTime / time << std::setw(18) << meanError << std::setw(17)
+                  << p95Error << std::endl;
+    }
+}
+
+/*
+ * Compare the block-wise Gabor backend with the direct per-pixel one for
+ * several block sizes: time of the Gabor stage and rate of the pixels with
+ * the same ridge value.
+ */
+void benchmarkBlock(const cv::Mat &input, int repeat) {
+    const int blockSizes[] = {0, 8, 16, 32, 64};
+    cv::Mat reference;
+    double referenceTime = 0;
+
+    std::cout << " block  gabor (ms)  speedup  agreement (%)" << std::endl;
+
+    // Block size 0 stands for the direct reference
+    for (int blockSize : blockSizes) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        if (blockSize == 0) {
+            parameters.gaborBackend = FPEnhancement::GABOR_DIRECT;
+        } else {
+            parameters.gaborBackend = FPEnhancement::GABOR_BLOCK;
+            parameters.gaborBlockSize = blockSize;
+        }
+        FPEnhancement fpEnhancement(parameters);
+
+        // Time of the Gabor stage of every timed run, without the warm up
+        cv::Mat enhanced;
+        std::vector<double> gaborTimes;
+        medianTime([&]() {
+            enhanced = fpEnhancement.extractFingerPrints(input);
+            gaborTimes.push_back(fpEnhancement.lastStats().gabor);
+        }, repeat);
+        gaborTimes.erase(gaborTimes.begin());
+        double time = median(gaborTimes);
+
+        if (blockSize == 0) {
+            reference = enhanced;
+            referenceTime = time;
+        }
+        cv::Mat mismatches = enhanced != reference;
+        double agreement = 1 - (double) cv::countNonZero(mismatches) / mismatches.total();
+
+        std::cout << std::fixed << std::setprecision(2);
+        if (blockSize == 0) {
+            std::cout << "direct";
+        } else {
+            std::cout << std::setw(6) << blockSize;
+        }
+        std::cout << std::setw(12) << time << std::setw(9) << referenceTime / time << std::setw(15)
+                  << 100 * agreement << std::endl;
+    }
+}
+
+/*
+ * Compare the fixed point Gabor filtering with the float one, both with the
+ * bucketed backend: time of the whole enhancement and rate of the pixels
+ * whose ridge value differs.
+ */
+void benchmarkFixedPoint(const cv::Mat &input, int repeat) {
+    cv::Mat results[2];
+    double times[2];
+
+    for (int fixed = 0; fixed < 2; fixed++) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.gaborBackend = FPEnhancement::GABOR_BUCKETED;
+        parameters.fixedPoint = fixed == 1;
+        FPEnhancement fpEnhancement(parameters);
+        times[fixed] = medianTime([&]() { results[fixed] = fpEnhancement.extractFingerPrints(input); },
+                                  repeat);
+    }
+
+    cv::Mat mismatches = results[0] != results[1];
+    double mismatchRate = (double) cv::countNonZero(mismatches) / mismatches.total();
+    double ridgeRate = (double) cv::countNonZero(results[0]) / results[0].total();
+
+    std::cout << "path     time (ms)  speedup" << std::endl;
+    std::cout << std::fixed << std::setprecision(2) << "float" << std::setw(13) << times[0]
+              << std::setw(9) << 1.0 << std::endl;
+    std::cout << "fixed" << std::setw(13) << times[1] << std::setw(9) << times[0] / times[1] << std::endl;
+    std::cout << std::setprecision(4) << "mismatching pixels: " << 100 * mismatchRate << "% ("
+              << 100 * ridgeRate << "% of the pixels are ridges)" << std::endl;
+}
+
+/*
+ * Time the enhancement for every angle increment dividing 180 from 3 to 15
+ * degrees, and compare the results with the 3 degrees reference.
+ */
+void benchmarkAngleInc(const cv::Mat &input, int repeat) {
+    const int angleIncs[] = {3, 4, 5, 6, 9, 10, 12, 15};
+    cv::Mat reference;
+    double megapixels = input.total() / 1e6;
+
+    std::cout << "angle  filters  bank (ms)  time (ms)  Mpx/s  agreement (%)" << std::endl;
+
+    for (int angleInc : angleIncs) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.angleInc = angleInc;
+        FPEnhancement fpEnhancement(parameters);
+
+        // Construction of the bank alone, out of the cache
+        double bankTime = medianTime([&]() {
+            GaborBank::clearCache();
+            GaborBank::get(parameters.kx, parameters.ky, parameters.freqValue, angleInc);
+        }, repeat);
+
+        cv::Mat enhanced;
+        double time = medianTime([&]() { enhanced = fpEnhancement.extractFingerPrints(input); }, repeat);
+
+        if (angleInc == 3) {
+            reference = enhanced;
+        }
+        cv::Mat mismatches = enhanced != reference;
+        double agreement = 1 - (double) cv::countNonZero(mismatches) / mismatches.total();
+
+        std::cout << std::fixed << std::setprecision(2) << std::setw(5) << angleInc << std::setw(9)
+                  << 180 / angleInc << std::setw(11) << bankTime << std::setw(11) << time << std::setw(7)
+                  << megapixels / time * 1000 << std::setw(15) << 100 * agreement << std::endl;
+    }
+}
+
+/*
+ * Compare the local normalization over several windows with the global
+ * one: time of the normalization stage and of the whole enhancement.
+ */
+void benchmarkNormalization(const cv::Mat &input, int repeat) {
+    const int windows[] = {0, 16, 32, 64, 128};
+    double referenceTime = 0;
+
+    std::cout << "window  normalization (ms)  slowdown  total (ms)" << std::endl;
+
+    // Window 0 stands for the global normalization
+    for (int window : windows) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.normalizationWindow = window;
+        FPEnhancement fpEnhancement(parameters);
+
+        // Time of the normalization stage of every timed run, without the warm up
+        std::vector<double> normalizationTimes;
+        double total = medianTime([&]() {
+            fpEnhancement.extractFingerPrints(input);
+            normalizationTimes.push_back(fpEnhancement.lastStats().normalization);
+        }, repeat);
+        normalizationTimes.erase(normalizationTimes.begin());
+        double time = median(normalizationTimes);
+
+        if (window == 0) {
+            referenceTime = time;
+        }
+
+        std::cout << std::fixed << std::setprecision(2);
+        if (window == 0) {
+            std::cout << "global";
+        } else {
+            std::cout << std::setw(6) << window;
+        }
+        std::cout << std::setw(20) << time << std::setw(10) << time / referenceTime << std::setw(12) << total
+                  << std::endl;
+    }
+}
+
+/*
+ * Run one extractor from `threadCount` threads at once, each with its own
+ * workspace, `repeat` times over several images, for every Gabor backend,
+ * tiled and masked. Every result must be identical to the one of a single
+ * threaded run. Return whether they all are.
+ */
+bool stressThreads(const cv::Mat &input, int threadCount, int repeat) {
+    // The input, downsized, mirrored, and a region which is not continuous
+    cv::vector<cv::Mat> images(4);
+    images[0] = input;
+    cv::resize(input, images[1], cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+    cv::flip(input, images[2], 1);
+    images[3] = input(cv::Rect(input.cols / 8, input.rows / 8, input.cols * 3 / 4, input.rows * 3 / 4));
+
+    struct Configuration {
+        std::string name;
+        FPEnhancement::Parameters parameters;
+        bool masked;
+    };
+
+    cv::vector<Configuration> configurations;
+    const int backends[] = {FPEnhancement::GABOR_DIRECT, FPEnhancement::GABOR_BUCKETED,
+                            FPEnhancement::GABOR_FFT, FPEnhancement::GABOR_BLOCK};
+    const char *backendNames[] = {"direct", "bucketed", "fft", "block"};
+    for (int b = 0; b < 4; b++) {
+        Configuration configuration = {backendNames[b], defaultParameters(), false};
+        configuration.parameters.gaborBackend = backends[b];
+        configurations.push_back(configuration);
+    }
+
+    // A quarter of the memory of the whole input splits it in several tiles
+    Configuration tiled = {"tiled", defaultParameters(), false};
+    tiled.parameters.memoryBudget = input.total() * 16 * sizeof(float) / 4;
+    configurations.push_back(tiled);
+    configurations.push_back({"masked", defaultParameters(), true});
+
+    bool identical = true;
+    std::cout << "configuration  runs  mismatches" << std::endl;
+
+    for (const Configuration &configuration : configurations) {
+        const FPEnhancement fpEnhancement(configuration.parameters);
+
+        // Single threaded references
+        cv::vector<cv::Mat> references(images.size());
+        Workspace referenceWorkspace;
+        for (size_t k = 0; k < images.size(); k++) {
+            references[k] = fpEnhancement.enhance(images[k], 0, configuration.masked, referenceWorkspace).enhanced;
+        }
+
+        // Each thread starts on another image, so that they all run at once
+        std::atomic<int> mismatches(0);
+        cv::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back([&, t]() {
+                Workspace workspace;
+                for (int r = 0; r < repeat; r++) {
+                    for (size_t n = 0; n < images.size(); n++) {
+                        size_t k = (t + n) % images.size();
+                        cv::Mat enhanced = fpEnhancement.enhance(images[k], 0, configuration.masked,
+                                                                 workspace).enhanced;
+                        if (enhanced.size() != references[k].size() ||
+                            cv::countNonZero(enhanced != references[k]) > 0) {
+                            mismatches++;
+                        }
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        identical = identical && mismatches == 0;
+        std::cout << std::setw(13) << configuration.name << std::setw(6) << threadCount * repeat * images.size()
+                  << std::setw(12) << mismatches.load() << std::endl;
+    }
+
+    return identical;
+}
+
+/*
+ * Check that the plain, masked and tiled extractions reject every invalid
+ * parameter set with a cv::Exception, instead of crashing. Return whether
+ * they all do.
+ */
+bool checkParameters(const cv::Mat &input) {
+    cv::vector<std::pair<std::string, FPEnhancement::Parameters>> cases;
+
+    // The pyramid of the orientation needs a power of two
+    const int orientationScales[] = {0, 3, -2};
+    for (int scale : orientationScales) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.orientationScale = scale;
+        cases.push_back(std::make_pair("orientation_scale=" + std::to_string(scale), parameters));
+    }
+
+    // The orientations of the Gabor banks wrap around at 180 degrees
+    const int angleIncs[] = {0, 7, -3};
+    for (int angleInc : angleIncs) {
+        FPEnhancement::Parameters parameters = defaultParameters();
+        parameters.angleInc = angleInc;
+        cases.push_back(std::make_pair("angle_inc=" + std::to_string(angleInc), parameters));
+    }
+
+    bool rejected = true;
+    std::cout << "parameters            plain     masked    tiled" << std::endl;
+
+    for (const auto &check : cases) {
+        std::cout << std::left << std::setw(22) << check.first;
+
+        for (int mode = 0; mode < 3; mode++) {
+            FPEnhancement::Parameters parameters = check.second;
+            if (mode == 2) {
+                parameters.memoryBudget = input.total() * 16 * sizeof(float) / 4;
+            }
+
+            bool thrown = false;
+            try {
+                FPEnhancement fpEnhancement(parameters);
+                fpEnhancement.enhance(input, 0, mode == 1);
+            } catch (const cv::Exception &) {
+                thrown = true;
+            }
+
+            rejected = rejected && thrown;
+            std::cout << std::setw(10) << (thrown ? "rejected" : "ACCEPTED");
+        }
+        std::cout << std::right << std::endl;
+    }
+
+    return rejected;
+}
+
 int main(int argc, char *argv[]) {
 
     // CLI management
@@ -79,7 +473,34 @@ int main(int argc, char *argv[]) {
             "min_rows", "Minimum number of rows",
             cxxopts::value<int>()->default_value("1000"))(
             "min_cols", "Minimum number of columns",
-            cxxopts::value<int>()->default_value("1000"))
+            cxxopts::value<int>()->default_value("1000"))(
+            "benchmark_orientation",
+            "Compare the speed and the error of the orientation field at each pyramid level",
+            cxxopts::value<bool>()->default_value("false"))(
+            "benchmark_block",
+            "Compare the speed and the result of the block-wise Gabor filtering with the per-pixel one",
+            cxxopts::value<bool>()->default_value("false"))(
+            "benchmark_fixed_point",
+            "Compare the speed and the result of the fixed point Gabor filtering with the float one",
+            cxxopts::value<bool>()->default_value("false"))(
+            "benchmark_angle_inc",
+            "Compare the speed and the result of the enhancement for several angle increments",
+            cxxopts::value<bool>()->default_value("false"))(
+            "benchmark_normalization",
+            "Compare the speed of the local normalization for several windows with the global one",
+            cxxopts::value<bool>()->default_value("false"))(
+            "stress_threads",
+            "Check that this number of threads sharing one extractor get the single threaded results",
+            cxxopts::value<int>()->default_value("0"))(
+            "check_parameters",
+            "Check that invalid parameters are rejected with an exception",
+            cxxopts::value<bool>()->default_value("false"))(
+            "angle_inc", "Angle between the orientations of the Gabor filters in degrees",
+            cxxopts::value<int>()->default_value("3"))(
+            "repeat", "Number of timed runs of the benchmarks",
+            cxxopts::value<int>()->default_value("10"))(
+            "profile", "Print the time spent in each stage as JSON",
+            cxxopts::value<bool>()->default_value("false"))
 
             ("h,help", "Print usage")("v,verbose", "Verbose output",
                                       cxxopts::value<bool>()->default_value("false"));
@@ -108,6 +529,12 @@ int main(int argc, char *argv[]) {
 
     int minRows = result["min_rows"].as<int>();
     int minCols = result["min_cols"].as<int>();
+    int angleInc = result["angle_inc"].as<int>();
+
+    if (angleInc <= 0 || 180 % angleInc != 0) {
+        std::cerr << "The angle increment has to divide 180" << std::endl;
+        exit(1);
+    }
 
     ///
 
@@ -132,27 +559,63 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Run the enhancement algorithm
-    FPEnhancement fpEnhancement(verbose=verbose);
-    cv::Mat enhancedImage = fpEnhancement.extractFingerPrints(input);
+    if (result["benchmark_orientation"].as<bool>()) {
+        benchmarkOrientation(input, std::max(result["repeat"].as<int>(), 1));
+        return 0;
+    }
 
-    // Finally applying the filter to get the end result
-    cv::Mat endResult(cv::Scalar::all(0));
+    if (result["benchmark_block"].as<bool>()) {
+        benchmarkBlock(input, std::max(result["repeat"].as<int>(), 1));
+        return 0;
+    }
 
-    if (performPostprocessing) {
-        // Apply the post processing for better results
-        cv::Mat filter = fpEnhancement.postProcessingFilter(input);
-
-        if (verbose) {
-            std::cout << "Type of the image  : " << getImageType(enhancedImage.type())
-                      << std::endl;
-            std::cout << "Type of the filter : " << getImageType(filter.type())
-                      << std::endl;
-        }
+    if (result["benchmark_fixed_point"].as<bool>()) {
+        benchmarkFixedPoint(input, std::max(result["repeat"].as<int>(), 1));
+        return 0;
+    }
 
-        enhancedImage.copyTo(endResult, filter);
+    if (result["benchmark_angle_inc"].as<bool>()) {
+        benchmarkAngleInc(input, std::max(result["repeat"].as<int>(), 1));
+        return 0;
+    }
+
+    if (result["check_parameters"].as<bool>()) {
+        return checkParameters(input) ? 0 : 1;
+    }
+
+    if (result["stress_threads"].as<int>() > 0) {
+        bool identical = stressThreads(input, result["stress_threads"].as<int>(),
+                                       std::max(result["repeat"].as<int>(), 1));
+        return identical ? 0 : 1;
+    }
+
+    if (result["benchmark_normalization"].as<bool>()) {
+        benchmarkNormalization(input, std::max(result["repeat"].as<int>(), 1));
+        return 0;
+    }
+
+    // Run the enhancement algorithm
+    FPEnhancement::Parameters parameters = defaultParameters();
+    parameters.verbose = verbose;
+    parameters.angleInc = angleInc;
+    FPEnhancement fpEnhancement(parameters);
+    cv::Mat endResult;
+
+    if (performPostprocessing) {
+        // Compute the post processing filter first, and only enhance
+        // the fingerprint it keeps
+        endResult = fpEnhancement.extractMaskedFingerPrints(input);
     } else {
-        endResult = enhancedImage;
+        endResult = fpEnhancement.extractFingerPrints(input);
+    }
+
+    if (result["profile"].as<bool>()) {
+        printProfile(fpEnhancement.lastStats());
+    }
+
+    if (verbose) {
+        std::cout << "Type of the image  : " << getImageType(endResult.type())
+                  << std::endl;
     }
 
     if (showResult) {
@@ -0,0 +1,217 @@
+// Author: Ekberjan Derman
+// Contributor : Baptiste Amato, Julien Jerphanion
+// Emails:
+//    ekberjanderman@gmail.com
+//    baptiste.amato@psycle.io
+//    git@jjerphan.xyz
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+    // Scheduler and worker index of the calling thread
+    thread_local Scheduler *currentScheduler = nullptr;
+    thread_local int currentWorker = -1;
+
+    // Makes the calling thread a worker for its lifetime
+    struct WorkerScope {
+        Scheduler *previousScheduler;
+        int previousWorker;
+
+        WorkerScope(Scheduler *scheduler, int worker) : previousScheduler(currentScheduler),
+                                                         previousWorker(currentWorker) {
+            currentScheduler = scheduler;
+            currentWorker = worker;
+        }
+
+        ~WorkerScope() {
+            currentScheduler = previousScheduler;
+            currentWorker = previousWorker;
+        }
+    };
+}
+
+Scheduler::Scheduler(int threadCount) : queued(0), stopping(false) {
+    if (threadCount <= 0) {
+        threadCount = std::max(cv::getNumberOfCPUs(), 1);
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        workers.emplace_back(new Worker());
+    }
+
+    // The first worker is the calling thread of run
+    for (int i = 1; i < threadCount; i++) {
+        threads.emplace_back(&Scheduler::loop, this, i);
+    }
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+Scheduler *Scheduler::current() {
+    return currentScheduler;
+}
+
+void Scheduler::run(const cv::vector<std::function<void()>> &tasks) {
+    if (currentScheduler == this) {
+        fork_join(currentWorker, tasks, false);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(runMutex);
+    WorkerScope scope(this, 0);
+    fork_join(0, tasks, true);
+}
+
+void Scheduler::parallelFor(const cv::Range &range, int stripeCount,
+                            const std::function<void(const cv::Range &)> &body) {
+    int length = range.end - range.start;
+    if (stripeCount <= 0) {
+        stripeCount = 4 * threadCount();
+    }
+    stripeCount = std::min(stripeCount, length);
+
+    if (stripeCount <= 1 || currentScheduler != this) {
+        body(range);
+        return;
+    }
+
+    cv::vector<std::function<void()>> stripes;
+    stripes.reserve(stripeCount);
+    for (int s = 0; s < stripeCount; s++) {
+        int start = range.start + (int) ((int64_t) length * s / stripeCount);
+        int end = range.start + (int) ((int64_t) length * (s + 1) / stripeCount);
+        stripes.push_back([&body, start, end]() { body(cv::Range(start, end)); });
+    }
+
+    fork_join(currentWorker, stripes, false);
+}
+
+/*
+ * Queue `bodies` and run tasks until they are all done. They are queued on
+ * the deque of `worker`, or dealt to every deque with `spread`.
+ */
+void Scheduler::fork_join(int worker, const cv::vector<std::function<void()>> &bodies, bool spread) {
+    Group group;
+    group.pending = (int) bodies.size();
+
+    // Queued in reverse order, so that the first ones are at the back of
+    // their deque and are run first by its thread
+    int count = threadCount();
+    for (int i = (int) bodies.size() - 1; i >= 0; i--) {
+        Worker &target = *workers[spread ? i % count : worker];
+        Task task = {bodies[i], &group};
+
+        std::lock_guard<std::mutex> lock(target.mutex);
+        target.tasks.push_back(std::move(task));
+        queued++;
+    }
+
+    // Taking the lock orders the wake up after the check of sleeping threads
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wakeUp.notify_all();
+
+    // Help with any task until the group is done. When none is queued, the
+    // missing ones are running on other threads: sleep until the last one
+    // completes the group or until another task is queued.
+    Task task;
+    while (group.pending.load() > 0) {
+        if (pop(worker, task)) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this, &group]() { return group.pending.load() == 0 || queued.load() > 0; });
+    }
+
+    if (group.error) {
+        std::rethrow_exception(group.error);
+    }
+}
+
+/*
+ * Take the newest task of the deque of `worker`, or else the oldest task
+ * of another deque.
+ */
+bool Scheduler::pop(int worker, Task &task) {
+    int count = threadCount();
+
+    for (int k = 0; k < count; k++) {
+        Worker &victim = *workers[(worker + k) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (victim.tasks.empty()) {
+            continue;
+        }
+
+        if (k == 0) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+        } else {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+
+    return false;
+}
+
+void Scheduler::execute(Task &task) {
+    Group &group = *task.group;
+
+    try {
+        task.body();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(group.errorMutex);
+        if (!group.error) {
+            group.error = std::current_exception();
+        }
+    }
+
+    // The group may be gone as soon as it is done, so it is not read after
+    task.body = nullptr;
+    bool completed = --group.pending == 0;
+
+    // Taking the lock orders the wake up after the check of the joining thread
+    if (completed) {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wakeUp.notify_all();
+    }
+}
+
+void Scheduler::loop(int worker) {
+    WorkerScope scope(this, worker);
+    Task task;
+
+    while (true) {
+        if (pop(worker, task)) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this]() { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0) {
+            return;
+        }
+    }
+}
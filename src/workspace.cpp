@@ -0,0 +1,47 @@
+// Author: Ekberjan Derman
+// Contributor : Baptiste Amato, Julien Jerphanion
+// Emails:
+//    ekberjanderman@gmail.com
+//    baptiste.amato@psycle.io
+//    git@jjerphan.xyz
+
+#include "workspace.h"
+
+cv::Mat Workspace::view(cv::Mat &buffer, int rows, int cols, int type) {
+    size_t bytes = (size_t) rows * cols * CV_ELEM_SIZE(type);
+
+    if (buffer.total() * buffer.elemSize() < bytes) {
+        buffer.create(1, (int) bytes, CV_8UC1);
+    }
+
+    // A continuous header rather than a region of a larger matrix, so that
+    // filters do not read the rest of the buffer as the image border
+    return cv::Mat(rows, cols, type, buffer.data);
+}
+
+Workspace::Lease::~Lease() {
+    if (!band) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(workspace->bandsMutex);
+    workspace->freeBands.push_back(std::move(band));
+}
+
+Workspace::Lease Workspace::band() {
+    std::unique_ptr<Band> band;
+
+    {
+        std::lock_guard<std::mutex> lock(bandsMutex);
+        if (!freeBands.empty()) {
+            band = std::move(freeBands.back());
+            freeBands.pop_back();
+        }
+    }
+
+    if (!band) {
+        band.reset(new Band());
+    }
+
+    return Lease(this, std::move(band));
+}